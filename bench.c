@@ -0,0 +1,100 @@
+/*
+ * Statistics for repeated timings
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "bench.h"
+
+/* The resampling is seeded the same way every time, so that the same
+   timings always give the same intervals */
+#define BENCH_SEED 0x9e3779b97f4a7c15ull
+
+static uint64_t next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double *new_array(int n) {
+    double *a = malloc((n > 0 ? n : 1) * sizeof(double));
+    if (!a) {
+	fprintf(stderr, "ERROR.  Couldn't allocate bootstrap samples\n");
+	exit(1);
+    }
+    return a;
+}
+
+/* Median of a, sorting it */
+static double median_of(double *a, int n) {
+    qsort(a, n, sizeof(double), compare_doubles);
+    return n % 2 ? a[n / 2] : (a[n / 2 - 1] + a[n / 2]) / 2;
+}
+
+/* Fill r with n values drawn from x with replacement */
+static void resample(const double *x, int n, double *r, uint64_t *state) {
+    for (int i = 0; i < n; i++)
+	r[i] = x[next(state) % n];
+}
+
+/* The (1 - conf) / 2 and (1 + conf) / 2 quantiles of the sorted stat */
+static void interval(double *stat, int resamples, double conf,
+		     double *lo, double *hi) {
+    qsort(stat, resamples, sizeof(double), compare_doubles);
+    int k = (int) ((1 - conf) / 2 * resamples);
+    *lo = stat[k];
+    *hi = stat[resamples - 1 - k];
+}
+
+double bench_median(const double *x, int n) {
+    double *a = new_array(n);
+    memcpy(a, x, n * sizeof(double));
+    double m = n > 0 ? median_of(a, n) : 0;
+    free(a);
+    return m;
+}
+
+double bench_mean(const double *x, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+	sum += x[i];
+    return n > 0 ? sum / n : 0;
+}
+
+void bench_ci_mean(const double *x, int n, double conf, int resamples,
+		   double *lo, double *hi) {
+    double *r = new_array(n), *stat = new_array(resamples);
+    uint64_t state = BENCH_SEED;
+
+    for (int b = 0; b < resamples; b++) {
+	resample(x, n, r, &state);
+	stat[b] = bench_mean(r, n);
+    }
+    interval(stat, resamples, conf, lo, hi);
+    free(r);
+    free(stat);
+}
+
+void bench_ci_ratio(const double *x, int n, const double *y, int m,
+		    double conf, int resamples, double *lo, double *hi) {
+    double *rx = new_array(n), *ry = new_array(m), *stat = new_array(resamples);
+    uint64_t state = BENCH_SEED;
+
+    for (int b = 0; b < resamples; b++) {
+	resample(x, n, rx, &state);
+	resample(y, m, ry, &state);
+	stat[b] = median_of(rx, n) / median_of(ry, m);
+    }
+    interval(stat, resamples, conf, lo, hi);
+    free(rx);
+    free(ry);
+    free(stat);
+}
@@ -0,0 +1,20 @@
+/*
+ * Statistics for repeated timings: medians and bootstrap confidence
+ * intervals, for comparing benchmark runs with a saved baseline.
+ */
+
+/* Median of x[0..n-1] (x is not changed) */
+double bench_median(const double *x, int n);
+
+/* Mean of x[0..n-1] */
+double bench_mean(const double *x, int n);
+
+/* Bootstrap confidence interval at level conf (e.g. 0.95) for the mean
+   of x[0..n-1], from resamples resamplings */
+void bench_ci_mean(const double *x, int n, double conf, int resamples,
+                   double *lo, double *hi);
+
+/* Bootstrap confidence interval at level conf for the ratio of the
+   medians of x[0..n-1] and y[0..m-1] */
+void bench_ci_ratio(const double *x, int n, const double *y, int m,
+                    double conf, int resamples, double *lo, double *hi);
@@ -141,3 +141,25 @@ double get_counter()
     return delta_secs * cpu_mhz * 1e6;
 }
 
+/* Measure the time stamp counter against the monotonic clock */
+#define TSC_CALIBRATE_NSECS 20000000
+
+double tsc_ghz()
+{
+    static double ghz = 0.0;
+    struct timespec start, now;
+    uint64_t tsc_start, tsc_end;
+    long nsecs;
+
+    if (ghz != 0.0)
+	return ghz;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tsc_start = read_tsc();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsecs = (now.tv_sec - start.tv_sec) * 1000000000l + (now.tv_nsec - start.tv_nsec);
+    } while (nsecs < TSC_CALIBRATE_NSECS);
+    tsc_end = read_tsc();
+    ghz = (double) (tsc_end - tsc_start) / nsecs;
+    return ghz;
+}
@@ -1,5 +1,11 @@
 /* Routines for timing functions */
 
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 /*  minimum resolution of timer (secs) */
 extern const double timer_resolution;
 
@@ -20,3 +26,19 @@ void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* Time stamp counter: cheap timestamps for timing single operations */
+static inline uint64_t read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    return __rdtscp(&aux);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/* Rate of read_tsc in ticks per nanosecond, measured on first use */
+double tsc_ghz();
@@ -46,18 +46,20 @@
   "syn-struct.rep"
 
 /*
- * Programs for measuring reference throughputs
+ * Where the throughputs of the built-in reference allocator (mm-ref.c)
+ * are cached, one line per host fingerprint
  */
-#define REF_DRIVER "./mdriver-ref"
+#define REF_CACHE_FILE "./throughputs.cache"
 
 
 /*
  * Speeds measured relative to a benchmark.  Express thresholds
- * relative to benchmark throughput
+ * relative to benchmark throughput (of mm-ref.c, about twice as fast as
+ * the old mdriver-ref, hence the low ratios)
  * Students get 0 points for this point or below (ops / sec)
  */
 #define MIN_SPEED_RATIO_CHECKPOINT 0.00
-#define MIN_SPEED_RATIO       0.30
+#define MIN_SPEED_RATIO       0.15
 /*
  * Students get 0 points for this allocation fraction or below
  */
@@ -69,8 +71,8 @@
  * Students can get more points for building faster allocators, up to
  * this point (in ops / sec)
  */
-#define MAX_SPEED_RATIO_CHECKPOINT 0.05
-#define MAX_SPEED_RATIO       0.90
+#define MAX_SPEED_RATIO_CHECKPOINT 0.025
+#define MAX_SPEED_RATIO       0.45
 
 /* 
  * Students can get more points for building more efficient allocators,
@@ -88,9 +90,48 @@
 #define UTIL_WEIGHT .60
 
 /*
- * Max number of random values written to each allocation 
-*/
-#define MAXFILL        1024
+ * Max number of random bytes written to (and checked at) each end of
+ * an allocation; 0 covers every payload in full.  Payloads of up to
+ * twice this are covered in full anyway.  Traces with gigabyte blocks
+ * rely on most of their pages never being touched.
+ */
+#define MAXFILL        65536
+
+/*
+ * With -L, replay each trace until at least this many requests have
+ * been timed individually
+ */
+#define LATENCY_MIN_OPS 200000
+
+/*
+ * With -U, sample the heap for the utilization timeline every this many
+ * requests (-N overrides it)
+ */
+#define TIMELINE_INTERVAL 1000
+
+/*
+ * With -F, sample fragmentation this many times over each trace, and
+ * count free blocks too small for all of the next FRAG_LOOKAHEAD
+ * requests as unusable
+ */
+#define FRAG_SAMPLES   1000
+#define FRAG_LOOKAHEAD 100
+
+/*
+ * Benchmark mode (-B): at most this many timings per trace, the level
+ * and number of resamples of the bootstrap confidence intervals, and
+ * the smallest throughput change reported as a regression
+ */
+#define BENCH_MAX_RUNS   100
+#define BENCH_CONFIDENCE 0.95
+#define BENCH_RESAMPLES  2000
+#define BENCH_MIN_CHANGE 0.01
+
+/*
+ * Cold-cache timing (-K): bytes read to flush the caches before each
+ * timed replay, more than the last level cache of any machine we use
+ */
+#define COLD_CACHE_BYTES (64ul<<20) /* 64 MB */
 
 /*
  * Alignment requirement in bytes (either 4, 8, or 16)
@@ -103,26 +144,63 @@
  */
 #define MAX_HEAP_SIZE (1ull*(1ull<<40)) /* 1 TB */
 
+/*
+ * Huge page size used to align the heap when running with -H
+ */
+#define HUGE_PAGE_SIZE (1ul<<21) /* 2 MB */
 
-/***************** Parameters for looking up reference throughput *********/
 /*
- * Location of information on CPU type 
+ * Bytes at the start of the heap taken from the hugetlb pool with -H
+ * (less if the free pool is smaller); the rest uses HUGE_PAGE_SIZE
+ * transparent huge pages
  */
-#define CPU_FILE "/proc/cpuinfo"
+#define MEM_HUGETLB_SIZE (1ul<<30) /* 1 GB */
 
+/*********** Parameters controlling the non-simulated page providers ********/
 /*
- * Key in file (spaces removed)
+ * Granularity of address space reservations
  */
-#define CPU_KEY "modelname"
+#define MEM_RESERVE_CHUNK (1ul<<26) /* 64 MB */
+
+/*
+ * Maximum number of non-contiguous heap segments
+ */
+#define MEM_MAX_SEGMENTS 1024
 
 /*
- * File containing throughputs
+ * Default backing file for the file provider
  */
-#define THROUGHPUT_FILE "./throughputs.txt"
+#define MEM_BACKING_FILE "./mm_heap.bin"
 
 /*
- * Keys for checkpoint vs. regular
+ * Persistent heaps: default file, the fixed address they are mapped at
+ * and their size (the file is sparse)
  */
-#define BENCH_KEY  "regular"
+#define MEM_PERSIST_FILE "./mm_persist.heap"
+#define MEM_PERSIST_BASE 0x500000000000ull
+#define MEM_PERSIST_SIZE (1ull<<34) /* 16 GB */
+
+/*
+ * Size of shared heaps (the memfd or shm object is sparse)
+ */
+#define MEM_SHARED_SIZE (1ull<<32) /* 4 GB */
+
+/*
+ * mem_memcpy and mem_memset store around the cache at this size and
+ * above, so that a huge realloc copy does not evict the heap metadata
+ */
+#define MEM_NT_THRESHOLD (1ul<<20) /* 1 MB */
+
+
+/***************** Parameters for identifying the host *********/
+/*
+ * Location of information on CPU type 
+ */
+#define CPU_FILE "/proc/cpuinfo"
+
+/*
+ * Key in file (spaces removed)
+ */
+#define CPU_KEY "modelname"
 
 #endif /* __CONFIG_H */
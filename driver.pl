@@ -36,18 +36,8 @@ if ($opt_s) {
     $timeout = $opt_s;
 }
 
-$callibration_flags = "";
 $driver_flags = "";
 
-# Run callibration program
-$callibration_prog = "./callibrate.pl";
-
-if (!-e $callibration_prog) {
-    die "Cannot find callibration program $callibration_prog\n";
-}
-
-system("$callibration_prog $callibration_flags");
-
 # Run macro checker
 $macro_check = `./macro-check.pl -f mm.c`;
 
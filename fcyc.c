@@ -1,7 +1,15 @@
 /* Compute time used by function f */
+#define _GNU_SOURCE
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/times.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "clock.h"
 #include "fcyc.h"
@@ -14,6 +22,8 @@
 #define CACHE_BLOCK 32
 #define MIN_TICKS 1000
 #define MIN_REPS 8
+#define WARMUP_PROBE 1e-3	/* secs of each clock speed probe */
+#define WARMUP_STEADY 3		/* probes in a row within epsilon */
 
 static long int kbest = K;
 static int clear_cache = CLEAR_CACHE;
@@ -24,12 +34,42 @@ static long int cache_block = CACHE_BLOCK;
 static long int min_reps = MIN_REPS;
 static long int min_ticks = MIN_TICKS;
 static double min_time = 0;
+static int pin_cpu = -1;
+static double warmup_secs = 0;
+static int discard_switches = 0;
+static long int discarded = 0;
 
 static long int *cache_buf = NULL;
 
 static double *values = NULL;
 static long int samplecount = 0;
 
+/* Hardware event counting */
+static unsigned event_mask = 0;
+static int event_fd[FCYC_NUM_EVENTS] = { -1, -1, -1, -1, -1, -1 };
+static double event_total[FCYC_NUM_EVENTS];
+static long int event_reps = 0;
+static pid_t event_tid = 0;	/* thread the counters were opened by */
+
+/* perf_event_open type and config of each fcyc_event_t */
+#define CACHE_MISS(cache) (PERF_COUNT_HW_CACHE_##cache | \
+			   (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+			   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char *name;		/* for fcyc_parse_events */
+    const char *label;		/* for fcyc_event_label */
+    unsigned type;
+    unsigned long long config;
+} events[FCYC_NUM_EVENTS] = {
+    { "instructions",  "instr",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles",        "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "l1d-misses",    "L1D",    PERF_TYPE_HW_CACHE, CACHE_MISS(L1D) },
+    { "llc-misses",    "LLC",    PERF_TYPE_HW_CACHE, CACHE_MISS(LL) },
+    { "dtlb-misses",   "dTLB",   PERF_TYPE_HW_CACHE, CACHE_MISS(DTLB) },
+    { "branch-misses", "brmiss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
 #define KEEP_VALS 0
 #define KEEP_SAMPLES 0
 
@@ -106,6 +146,8 @@ static void clear()
 	    fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
 	    exit(1);
 	}
+	/* untouched pages would all read the one zero page */
+	memset(cache_buf, 1, cache_bytes);
     }
     cptr = (long int *) cache_buf;
     cend = cptr + cache_bytes/sizeof(long int);
@@ -116,6 +158,155 @@ static void clear()
     sink = x;
 }
 
+/* Code to control noise */
+
+static cpu_set_t saved_cpus;
+static int pinned = 0;
+
+/* Move this thread to pin_cpu, if set, remembering where it could run */
+static void pin()
+{
+    cpu_set_t set;
+    pinned = 0;
+    if (pin_cpu < 0 || sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) != 0)
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpu, &set);
+    pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void unpin()
+{
+    if (pinned)
+	sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    pinned = 0;
+}
+
+/* Seconds taken by a chain of iters dependent adds */
+static double spin(long iters)
+{
+    long int x = sink;
+    long i;
+    start_timer();
+    for (i = 0; i < iters; i++) {
+	x += i;
+	__asm__ volatile("" : "+r" (x));
+    }
+    sink = x;
+    return get_timer();
+}
+
+/*
+ * Spin until the clock has ramped up, which is when WARMUP_STEADY
+ * probes in a row take the same time within epsilon, or for
+ * warmup_secs at most.
+ */
+static void warm_up()
+{
+    static long iters = 1000;
+    double total = 0, prev = 0, t;
+    int steady = 0;
+
+    if (warmup_secs <= 0)
+	return;
+    while ((t = spin(iters)) < WARMUP_PROBE) {
+	total += t;
+	iters += iters;
+    }
+    while (total < warmup_secs && steady < WARMUP_STEADY) {
+	t = spin(iters);
+	total += t;
+	if (t <= (1 + epsilon) * prev && prev <= (1 + epsilon) * t)
+	    steady++;
+	else
+	    steady = 0;
+	prev = t;
+    }
+}
+
+/* Context switches of this thread so far */
+static long context_switches()
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) != 0)
+	return 0;
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/* Code to count hardware events with perf_event_open */
+
+/*
+ * Open a user-mode counter for event e on this thread.  Counters are
+ * not grouped, so the kernel may multiplex them when there are more
+ * than the PMU has; the enabled and running times let us scale for it.
+ */
+static int open_counter(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_events()
+{
+    int e;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+	if (event_fd[e] < 0)
+	    continue;
+	ioctl(event_fd[e], PERF_EVENT_IOC_RESET, 0);
+	ioctl(event_fd[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void stop_events(long reps)
+{
+    unsigned long long value[3];	/* count, time enabled, time running */
+    int e;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+	if (event_fd[e] >= 0)
+	    ioctl(event_fd[e], PERF_EVENT_IOC_DISABLE, 0);
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+	if (event_fd[e] < 0)
+	    continue;
+	if (read(event_fd[e], value, sizeof(value)) == sizeof(value) &&
+	    value[2] > 0)
+	    event_total[e] += (double) value[0] * value[1] / value[2];
+    }
+    event_reps += reps;
+}
+
+/*
+ * Counters count the thread that opened them, so a forked -P worker,
+ * or another thread, must not use the ones it inherited.
+ */
+static void init_events()
+{
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+    int e;
+    if (tid != event_tid) {
+	for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+	    if (event_fd[e] >= 0)
+		close(event_fd[e]);
+	    event_fd[e] = -1;
+	}
+	event_tid = tid;
+    }
+    event_reps = 0;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+	event_total[e] = 0;
+	if ((event_mask & (1u << e)) && event_fd[e] < 0)
+	    event_fd[e] = open_counter(e);
+    }
+}
+
 double fcyc(test_funct f, void *args)
 {
     double result;
@@ -156,46 +347,74 @@ double fcyc(test_funct f, void *args)
     return result;  
 }
 
+/*
+ * Run f reps times and return the seconds it took.  With clear_cache,
+ * the cache is cleared before every call, and only the calls are timed.
+ */
+static double run_reps(test_funct f, void *args, long reps)
+{
+    double sec = 0.0;
+    long r;
+    if (!clear_cache) {
+	start_events();
+	start_timer();
+	for (r = 0; r < reps; r++) {
+	    f(args);
+	}
+	sec = get_timer();
+	stop_events(reps);
+	return sec;
+    }
+    for (r = 0; r < reps; r++) {
+	clear();
+	start_events();
+	start_timer();
+	f(args);
+	sec += get_timer();
+	stop_events(1);
+    }
+    return sec;
+}
+
 double fsec(test_funct f, void *args)
 {
     double result;
     /* Increase reps until get meaningful times */
     long reps = min_reps;
-    long r;
+    long switches = 0;
     double sec = 0.0;
+    double dirty = 0.0;		/* best of the discarded samples */
+    pin();
+    warm_up();
     init_min_time();
     while (sec < min_time) {
-	if (clear_cache)
-	    clear();
-	start_timer();
-	for (r = 0; r < reps; r++) {
-	    f(args);
-	}
-	sec = get_timer();
+	sec = run_reps(f, args, reps);
 	if (sec < min_time)
 	    reps += reps;
-	//	printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
     }
     init_sampler();
-    //    printf("\nuSecs (reps=%ld):", reps);
+    init_events();
+    discarded = 0;
     do {
-	if (clear_cache)
-	    clear();
-	start_timer();
-	for (r = 0; r < reps; r++) {
-	    f(args);
-	}
-	sec = get_timer()/reps;
-	//	printf(" %.3f", sec * 1e6);
-	if (sec > 0.0)
+	if (discard_switches)
+	    switches = context_switches();
+	sec = run_reps(f, args, reps)/reps;
+	if (discard_switches && context_switches() != switches) {
+	    /* preempted or blocked: the sample timed someone else too */
+	    if (dirty == 0.0 || sec < dirty)
+		dirty = sec;
+	    discarded++;
+	} else if (sec > 0.0) {
 	    add_sample(sec);
-    } while (!has_converged() && samplecount < maxsamples);
-    result = values[0];
-    //    printf(" --> %.3f\n", result * 1e6);
+	}
+    } while (!has_converged() && samplecount + discarded < maxsamples);
+    /* if every sample was disturbed, the best of them will have to do */
+    result = samplecount > 0 ? values[0] : dirty;
 #if !KEEP_VALS
     free(values); 
     values = NULL;
 #endif
+    unpin();
     return result;  
 }
 
@@ -268,7 +487,106 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+/* Select the events fsec counts, as a mask of 1 << fcyc_event_t
+   Default = 0
+*/
+void set_fcyc_events(unsigned mask)
+{
+    int e;
+    event_mask = mask;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+	if (!(mask & (1u << e)) && event_fd[e] >= 0) {
+	    close(event_fd[e]);
+	    event_fd[e] = -1;
+	}
+    }
+}
 
+/* Mask of the events in a comma-separated list of names, or "all".
+   Returns -1 if a name is unknown
+*/
+long fcyc_parse_events(const char *list)
+{
+    long mask = 0;
+    const char *p = list;
+    int e;
+
+    while (*p != '\0') {
+	size_t len = strcspn(p, ",");
+	if (len == 3 && strncmp(p, "all", 3) == 0) {
+	    mask |= (1u << FCYC_NUM_EVENTS) - 1;
+	} else {
+	    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+		if (strlen(events[e].name) == len &&
+		    strncmp(p, events[e].name, len) == 0)
+		    break;
+	    if (e == FCYC_NUM_EVENTS)
+		return -1;
+	    mask |= 1u << e;
+	}
+	p += len;
+	if (*p == ',')
+	    p++;
+    }
+    return mask;
+}
+
+/* Name of event e, as in the list given to fcyc_parse_events */
+const char *fcyc_event_name(fcyc_event_t e)
+{
+    return events[e].name;
+}
+
+/* Short name of event e, for column headings */
+const char *fcyc_event_label(fcyc_event_t e)
+{
+    return events[e].label;
+}
+
+/* Average count of event e per call of f during the last fsec.
+   Returns -1 if it was not counted or the counter is unavailable
+*/
+double fsec_event(fcyc_event_t e)
+{
+    if (!(event_mask & (1u << e)) || event_fd[e] < 0 || event_reps == 0)
+	return -1.0;
+    return event_total[e] / event_reps;
+}
+
+/* Pin the thread calling fsec to CPU cpu while it samples, or not
+   if cpu is negative.  Returns -1 if this thread may not run on cpu
+   Default = -1
+*/
+int set_fcyc_cpu(int cpu)
+{
+    cpu_set_t set;
+    if (cpu >= CPU_SETSIZE ||
+	(cpu >= 0 && (sched_getaffinity(0, sizeof(set), &set) != 0 ||
+		      !CPU_ISSET(cpu, &set))))
+	return -1;
+    pin_cpu = cpu;
+    return 0;
+}
 
+/* Before sampling, spin for up to secs until the clock speed is steady
+   Default = 0
+*/
+void set_fcyc_warmup(double secs)
+{
+    warmup_secs = secs;
+}
 
+/* When set, fsec discards samples during which its thread was switched
+   out, unless all of them were
+   Default = 0
+*/
+void set_fcyc_discard_switches(int discard)
+{
+    discard_switches = discard;
+}
 
+/* Number of samples the last fsec discarded */
+long fsec_discarded()
+{
+    return discarded;
+}
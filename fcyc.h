@@ -59,5 +59,55 @@ void set_fcyc_maxsamples(long int maxsamples);
 */
 void set_fcyc_epsilon(double epsilon);
 
+/* Pin the thread calling fsec to CPU cpu while it samples, or not
+   if cpu is negative.  Returns -1 if this thread may not run on cpu
+   Default = -1
+*/
+int set_fcyc_cpu(int cpu);
 
+/* Before sampling, spin for up to secs until the clock speed is steady
+   Default = 0
+*/
+void set_fcyc_warmup(double secs);
 
+/* When set, fsec discards samples during which its thread was switched
+   out, unless all of them were
+   Default = 0
+*/
+void set_fcyc_discard_switches(int discard);
+
+/* Number of samples the last fsec discarded */
+long fsec_discarded();
+
+/* Hardware events that fsec can count while it samples */
+typedef enum {
+    FCYC_INSTRUCTIONS,
+    FCYC_CYCLES,
+    FCYC_L1D_MISSES,    /* L1 data cache load misses */
+    FCYC_LLC_MISSES,    /* last level cache load misses */
+    FCYC_DTLB_MISSES,   /* dTLB load misses */
+    FCYC_BRANCH_MISSES,
+    FCYC_NUM_EVENTS
+} fcyc_event_t;
+
+/* Select the events fsec counts, as a mask of 1 << fcyc_event_t
+   Default = 0
+*/
+void set_fcyc_events(unsigned mask);
+
+/* Mask of the events in a comma-separated list of names (instructions,
+   cycles, l1d-misses, llc-misses, dtlb-misses, branch-misses) or "all".
+   Returns -1 if a name is unknown
+*/
+long fcyc_parse_events(const char *list);
+
+/* Name of event e, as in the list given to fcyc_parse_events */
+const char *fcyc_event_name(fcyc_event_t e);
+
+/* Short name of event e, for column headings */
+const char *fcyc_event_label(fcyc_event_t e);
+
+/* Average count of event e per call of f during the last fsec.
+   Returns -1 if it was not counted or the counter is unavailable
+*/
+double fsec_event(fcyc_event_t e);
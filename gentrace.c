@@ -0,0 +1,510 @@
+/*
+ * gentrace - generate a synthetic trace from a parameterized workload
+ *
+ * usage: gentrace [options] <trace.rep|trace.bin>
+ *
+ * The workload is a sequence of phases.  Each phase makes a number of
+ * allocations whose sizes and lifetimes (counted in allocations) are
+ * drawn from the distributions below; a block may grow through a chain
+ * of reallocs during its life, and a fraction of blocks live until the
+ * end of the trace.  When a peak is set, the blocks due to die soonest
+ * are freed early to stay under it.  Options apply to the current
+ * phase; -p starts a new phase that inherits them.
+ *
+ *   -s <seed>         seed of the generator (same seed, same trace)
+ *   -w <weight>       weight written to the trace header (default 1)
+ *   -n <allocs>       allocations in this phase (default 10000)
+ *   -z <sizes>        powerlaw:<min>:<max>:<alpha>  (default 16:4096:1.5)
+ *                     bimodal:<small>:<large>:<fraction small>
+ *                     uniform:<min>:<max>
+ *                     hist:<file>   lines of "<size> <weight>"
+ *                     (sizes are at least 1, smaller first)
+ *   -l <lifetime>     exp:<mean>  uniform:<min>:<max>  fixed:<n>
+ *                     (default exp:100)
+ *   -k <fraction>     fraction of blocks that are never freed early
+ *   -r <p>:<g>:<n>    with probability p, a block is reallocated n times
+ *                     over its life, growing by a factor g each time
+ *   -b <bytes>        peak live bytes (K, M and G suffixes allowed)
+ *   -p                start a new phase
+ *
+ * For example, fragmentation after a phase shift:
+ *
+ *   gentrace -s 1 -z uniform:16:64 -l exp:50 -k 0.1 -n 50000 \
+ *            -p -z uniform:1024:8192 -k 0 -n 5000 frag.rep
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tracebin.h"
+
+#define MAX_PHASES 64
+#define MAX_SIZE   ((uint64_t) 1 << 40)
+
+typedef enum { SIZE_POWERLAW, SIZE_BIMODAL, SIZE_UNIFORM, SIZE_HIST } size_dist_t;
+typedef enum { LIFE_EXP, LIFE_UNIFORM, LIFE_FIXED } life_dist_t;
+
+typedef struct {
+    size_dist_t dist;
+    double a, b, c;
+    int hist_len;
+    uint64_t *hist_size;        /* empirical histogram: sizes and */
+    double *hist_cum;           /* cumulative weights */
+} size_model_t;
+
+typedef struct {
+    long allocs;
+    size_model_t size;
+    life_dist_t life;
+    double life_a, life_b;
+    double keep;                /* fraction of permanent blocks */
+    double realloc_p, realloc_growth;
+    int realloc_count;
+    uint64_t peak;              /* 0 for no limit */
+} phase_t;
+
+typedef struct {
+    uint64_t size;
+    bool live, permanent;
+    int reallocs_left;
+    uint64_t interval;          /* allocations between reallocs */
+    double growth;
+} gen_block_t;
+
+/* Pending realloc or free of a live block; each has exactly one */
+typedef struct {
+    uint64_t time;
+    int id;
+} event_t;
+
+typedef struct {
+    int type;
+    int id;
+    uint64_t size;
+} request_t;
+
+static uint64_t rng_state;
+
+static event_t *heap;
+static int heap_len, heap_cap;
+
+static gen_block_t *blocks;
+static int num_ids, cap_ids;
+static int *free_ids;
+static int num_free;
+
+static request_t *reqs;
+static size_t num_reqs, cap_reqs;
+static uint64_t live_bytes, peak_bytes;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-w weight] [-n allocs] [-z sizes] "
+            "[-l lifetime] [-k fraction] [-r p:growth:count] [-b bytes] "
+            "[-p ...] <trace.rep|trace.bin>\n", prog);
+    exit(1);
+}
+
+static void die(const char *msg, const char *arg)
+{
+    fprintf(stderr, "gentrace: %s: %s\n", msg, arg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        perror("gentrace");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * rng_next - splitmix64, so that traces do not depend on the C library
+ */
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * parse_bytes - a byte count with an optional K, M or G suffix
+ */
+static uint64_t parse_bytes(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+    case 'G': case 'g': v *= 1024;      /* fall through */
+    case 'M': case 'm': v *= 1024;      /* fall through */
+    case 'K': case 'k': v *= 1024; end++; break;
+    }
+    if (end == s || *end != '\0' || v < 0)
+        die("bad byte count", s);
+    return (uint64_t) v;
+}
+
+static void load_hist(size_model_t *m, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    unsigned long long size;
+    double weight, total = 0;
+    int cap = 0;
+
+    if (fp == NULL)
+        die(strerror(errno), path);
+    m->hist_len = 0;
+    while (fscanf(fp, "%llu %lf", &size, &weight) == 2) {
+        if (weight < 0)
+            die("negative weight in histogram", path);
+        if (size == 0)
+            die("size 0 in histogram", path);
+        if (m->hist_len == cap) {
+            cap = cap ? 2 * cap : 64;
+            m->hist_size = xrealloc(m->hist_size, cap * sizeof(uint64_t));
+            m->hist_cum = xrealloc(m->hist_cum, cap * sizeof(double));
+        }
+        total += weight;
+        m->hist_size[m->hist_len] = size;
+        m->hist_cum[m->hist_len++] = total;
+    }
+    if (!feof(fp) || m->hist_len == 0 || total <= 0)
+        die("bad histogram", path);
+    fclose(fp);
+}
+
+/*
+ * parse_sizes - returns false unless every size is at least 1, the
+ *     smaller one comes first and the fraction is in [0, 1]
+ */
+static bool parse_sizes(size_model_t *m, const char *spec)
+{
+    if (sscanf(spec, "powerlaw:%lf:%lf:%lf", &m->a, &m->b, &m->c) == 3 &&
+        m->a >= 1 && m->b >= m->a && m->c > 0)
+        m->dist = SIZE_POWERLAW;
+    else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &m->a, &m->b, &m->c) == 3 &&
+             m->a >= 1 && m->b >= m->a && m->c >= 0 && m->c <= 1)
+        m->dist = SIZE_BIMODAL;
+    else if (sscanf(spec, "uniform:%lf:%lf", &m->a, &m->b) == 2 &&
+             m->a >= 1 && m->b >= m->a)
+        m->dist = SIZE_UNIFORM;
+    else if (strncmp(spec, "hist:", 5) == 0) {
+        m->dist = SIZE_HIST;
+        m->hist_size = NULL;
+        m->hist_cum = NULL;
+        load_hist(m, spec + 5);
+    } else {
+        fprintf(stderr, "gentrace: bad size distribution: %s\n", spec);
+        return false;
+    }
+    return true;
+}
+
+static void parse_life(phase_t *ph, const char *spec)
+{
+    if (sscanf(spec, "exp:%lf", &ph->life_a) == 1 && ph->life_a > 0)
+        ph->life = LIFE_EXP;
+    else if (sscanf(spec, "uniform:%lf:%lf", &ph->life_a, &ph->life_b) == 2 &&
+             ph->life_a >= 1 && ph->life_b >= ph->life_a)
+        ph->life = LIFE_UNIFORM;
+    else if (sscanf(spec, "fixed:%lf", &ph->life_a) == 1 && ph->life_a >= 1)
+        ph->life = LIFE_FIXED;
+    else
+        die("bad lifetime distribution", spec);
+}
+
+static uint64_t draw_size(const size_model_t *m)
+{
+    double u = rng_unit(), x;
+    int lo, hi;
+
+    switch (m->dist) {
+    case SIZE_POWERLAW:
+        /* inverse CDF of a Pareto distribution bounded to [a, b] */
+        x = m->a / pow(1 - u * (1 - pow(m->a / m->b, m->c)), 1 / m->c);
+        break;
+    case SIZE_BIMODAL:
+        x = u < m->c ? m->a : m->b;
+        break;
+    case SIZE_UNIFORM:
+        x = m->a + floor(u * (m->b - m->a + 1));
+        break;
+    default:
+        u *= m->hist_cum[m->hist_len - 1];
+        for (lo = 0, hi = m->hist_len - 1; lo < hi; ) {
+            int mid = (lo + hi) / 2;
+            if (m->hist_cum[mid] > u)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return m->hist_size[lo];
+    }
+    return x > MAX_SIZE ? MAX_SIZE : (uint64_t) x;
+}
+
+static uint64_t draw_life(const phase_t *ph)
+{
+    double x;
+    switch (ph->life) {
+    case LIFE_EXP:
+        x = -ph->life_a * log(1 - rng_unit());
+        break;
+    case LIFE_UNIFORM:
+        x = ph->life_a + floor(rng_unit() * (ph->life_b - ph->life_a + 1));
+        break;
+    default:
+        x = ph->life_a;
+    }
+    return x < 1 ? 1 : (uint64_t) x;
+}
+
+/*
+ * Min-heap of pending events, ordered by time and then id so that the
+ * trace does not depend on the heap's internals
+ */
+static bool event_before(const event_t *x, const event_t *y)
+{
+    return x->time < y->time || (x->time == y->time && x->id < y->id);
+}
+
+static void heap_push(uint64_t time, int id)
+{
+    int i;
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? 2 * heap_cap : 1024;
+        heap = xrealloc(heap, heap_cap * sizeof(event_t));
+    }
+    for (i = heap_len++; i > 0; i = (i - 1) / 2) {
+        event_t *parent = &heap[(i - 1) / 2];
+        if (!event_before(&(event_t) { time, id }, parent))
+            break;
+        heap[i] = *parent;
+    }
+    heap[i] = (event_t) { time, id };
+}
+
+static event_t heap_pop(void)
+{
+    event_t top = heap[0], last = heap[--heap_len];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < heap_len) {
+        if (child + 1 < heap_len && event_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!event_before(&heap[child], &last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void emit(int type, int id, uint64_t size)
+{
+    if (num_reqs == cap_reqs) {
+        cap_reqs = cap_reqs ? 2 * cap_reqs : 4096;
+        reqs = xrealloc(reqs, cap_reqs * sizeof(request_t));
+    }
+    reqs[num_reqs++] = (request_t) { type, id, size };
+}
+
+static void set_size(int id, uint64_t size)
+{
+    live_bytes += size - blocks[id].size;
+    blocks[id].size = size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+static void free_block(int id)
+{
+    emit(TRACE_FREE, id, 0);
+    live_bytes -= blocks[id].size;
+    blocks[id].live = false;
+    free_ids[num_free++] = id;
+}
+
+/*
+ * fire - run the pending event of a block: its next realloc, or its free
+ */
+static void fire(event_t ev, bool force_free)
+{
+    gen_block_t *b = &blocks[ev.id];
+    uint64_t size;
+
+    if (force_free || b->reallocs_left == 0) {
+        free_block(ev.id);
+        return;
+    }
+    b->reallocs_left--;
+    size = (uint64_t) ceil(b->size * b->growth);
+    if (size > MAX_SIZE)
+        size = MAX_SIZE;
+    emit(TRACE_REALLOC, ev.id, size);
+    set_size(ev.id, size);
+    if (b->reallocs_left > 0 || !b->permanent)
+        heap_push(ev.time + b->interval, ev.id);
+}
+
+static void allocate(const phase_t *ph, uint64_t now)
+{
+    uint64_t size = draw_size(&ph->size), life = draw_life(ph);
+    gen_block_t *b;
+    int id;
+
+    /* stay under the peak by freeing the blocks due soonest */
+    while (ph->peak > 0 && live_bytes + size > ph->peak && heap_len > 0)
+        fire(heap_pop(), true);
+
+    if (num_free > 0) {
+        id = free_ids[--num_free];
+    } else {
+        if (num_ids == cap_ids) {
+            cap_ids = cap_ids ? 2 * cap_ids : 1024;
+            blocks = xrealloc(blocks, cap_ids * sizeof(gen_block_t));
+            free_ids = xrealloc(free_ids, cap_ids * sizeof(int));
+        }
+        id = num_ids++;
+    }
+    b = &blocks[id];
+    b->size = 0;
+    b->live = true;
+    b->permanent = rng_unit() < ph->keep;
+    b->reallocs_left = rng_unit() < ph->realloc_p ? ph->realloc_count : 0;
+    b->growth = ph->realloc_growth;
+    b->interval = life / (b->reallocs_left + 1);
+    if (b->interval == 0)
+        b->interval = 1;
+    emit(TRACE_ALLOC, id, size);
+    set_size(id, size);
+    if (b->reallocs_left > 0 || !b->permanent)
+        heap_push(now + b->interval, id);
+}
+
+static void write_trace(const char *path, int weight)
+{
+    size_t len = strlen(path), i;
+    tracebin_writer_t writer;
+    FILE *fp;
+
+    if (len > 4 && strcmp(path + len - 4, ".bin") == 0) {
+        if (!tracebin_create(&writer, path, weight))
+            die(strerror(errno), path);
+        for (i = 0; i < num_reqs; i++)
+            if (!tracebin_append(&writer, reqs[i].type, reqs[i].id,
+                                 reqs[i].size))
+                die(strerror(errno), path);
+        if (!tracebin_finish(&writer, peak_bytes))
+            die(strerror(errno), path);
+        return;
+    }
+
+    if ((fp = fopen(path, "w")) == NULL)
+        die(strerror(errno), path);
+    fprintf(fp, "%d\n%d\n%zu\n%llu\n", weight, num_ids, num_reqs,
+            (unsigned long long) peak_bytes);
+    for (i = 0; i < num_reqs; i++) {
+        if (reqs[i].type == TRACE_FREE)
+            fprintf(fp, "f %d\n", reqs[i].id);
+        else
+            fprintf(fp, "%c %d %llu\n", reqs[i].type == TRACE_ALLOC ? 'a' : 'r',
+                    reqs[i].id, (unsigned long long) reqs[i].size);
+    }
+    if (fclose(fp) != 0)
+        die(strerror(errno), path);
+}
+
+int main(int argc, char **argv)
+{
+    phase_t phases[MAX_PHASES];
+    phase_t *ph = &phases[0];
+    int num_phases = 1, weight = 1, c, i;
+    uint64_t now = 0;
+    long n;
+
+    memset(ph, 0, sizeof(*ph));
+    ph->allocs = 10000;
+    parse_sizes(&ph->size, "powerlaw:16:4096:1.5");
+    parse_life(ph, "exp:100");
+    rng_state = 1;
+
+    while ((c = getopt(argc, argv, "s:w:n:z:l:k:r:b:ph")) != EOF) {
+        switch (c) {
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            if (weight < 0 || weight > 3)
+                die("weight can only be in {0, 1, 2, 3}", optarg);
+            break;
+        case 'n':
+            ph->allocs = atol(optarg);
+            if (ph->allocs < 0)
+                die("bad allocation count", optarg);
+            break;
+        case 'z':
+            if (!parse_sizes(&ph->size, optarg))
+                usage(argv[0]);
+            break;
+        case 'l':
+            parse_life(ph, optarg);
+            break;
+        case 'k':
+            ph->keep = atof(optarg);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf:%lf:%d", &ph->realloc_p,
+                       &ph->realloc_growth, &ph->realloc_count) != 3 ||
+                ph->realloc_growth <= 0 || ph->realloc_count < 0)
+                die("bad realloc chain", optarg);
+            break;
+        case 'b':
+            ph->peak = parse_bytes(optarg);
+            break;
+        case 'p':
+            if (num_phases == MAX_PHASES)
+                die("too many phases", "-p");
+            phases[num_phases] = *ph;
+            ph = &phases[num_phases++];
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    for (i = 0; i < num_phases; i++) {
+        for (n = 0; n < phases[i].allocs; n++, now++) {
+            while (heap_len > 0 && heap[0].time <= now)
+                fire(heap_pop(), false);
+            allocate(&phases[i], now);
+        }
+    }
+
+    /* free what is left, pending events first, so the trace is balanced */
+    while (heap_len > 0)
+        fire(heap_pop(), true);
+    for (i = 0; i < num_ids; i++)
+        if (blocks[i].live)
+            free_block(i);
+
+    write_trace(argv[optind], weight);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Log-bucketed latency histograms
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "hist.h"
+
+/* Bucket holding value */
+static int bucket_of(uint64_t value) {
+    if (value < HIST_SUB)
+	return (int) value;
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+/* Largest value that falls in bucket b */
+static uint64_t bucket_high(int b) {
+    if (b < HIST_SUB)
+	return (uint64_t) b;
+    int shift = b / HIST_SUB - 1;
+    uint64_t sub = (uint64_t) (b % HIST_SUB + HIST_SUB);
+    return ((sub + 1) << shift) - 1;
+}
+
+hist_t *hist_new() {
+    hist_t *hist = calloc(1, sizeof(hist_t));
+    if (!hist) {
+	fprintf(stderr, "ERROR.  Couldn't create histogram\n");
+	exit(1);
+    }
+    return hist;
+}
+
+void hist_free(hist_t *hist) {
+    free(hist);
+}
+
+void hist_reset(hist_t *hist) {
+    memset(hist, 0, sizeof(hist_t));
+}
+
+void hist_add(hist_t *hist, uint64_t value) {
+    hist->counts[bucket_of(value)]++;
+    hist->count++;
+    if (value > hist->max)
+	hist->max = value;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+    int b;
+    for (b = 0; b < HIST_BUCKETS; b++)
+	dst->counts[b] += src->counts[b];
+    dst->count += src->count;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+uint64_t hist_percentile(const hist_t *hist, double pct) {
+    uint64_t rank, seen = 0;
+    int b;
+
+    if (hist->count == 0)
+	return 0;
+    rank = (uint64_t) (pct / 100.0 * hist->count + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+	seen += hist->counts[b];
+	if (seen >= rank)
+	    break;
+    }
+    /* the top bucket can be much wider than what landed in it */
+    uint64_t high = bucket_high(b);
+    return high < hist->max ? high : hist->max;
+}
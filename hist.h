@@ -0,0 +1,33 @@
+/*
+ * Log-bucketed latency histograms, in the style of HdrHistogram:
+ * values below 2^HIST_SUB_BITS are counted exactly, and every power of
+ * two above that is split into 2^HIST_SUB_BITS linear sub-buckets, so
+ * any recorded value is known to within 1/2^HIST_SUB_BITS (about 6%).
+ */
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t count;                 /* number of values recorded */
+    uint64_t max;                   /* largest value recorded */
+    uint64_t counts[HIST_BUCKETS];
+} hist_t;
+
+hist_t *hist_new();
+
+void hist_free(hist_t *hist);
+
+void hist_reset(hist_t *hist);
+
+/* Record one value */
+void hist_add(hist_t *hist, uint64_t value);
+
+/* Add every value recorded in src to dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* Smallest value that pct percent of the recorded values do not exceed
+   (up to the bucket precision).  Returns 0 for an empty histogram */
+uint64_t hist_percentile(const hist_t *hist, double pct);
@@ -8,6 +8,7 @@
  * reserved.  May not be used, modified, or copied without permission.
  */
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <float.h>
 #include <setjmp.h>
@@ -20,12 +21,26 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
 #include "config.h"
-#include "stree.h"
+#include "shadow.h"
+#include "bench.h"
+#include "clock.h"
+#include "hist.h"
+#include "tracebin.h"
+#include "tracestream.h"
+#include "nativetrace.h"
+#include "mmplugin.h"
 
 /**********************
  * Constants and macros
@@ -34,12 +49,22 @@
 /* Misc */
 #define MAXLINE     1024          /* max string size */
 #define HDRLINES       4          /* number of header lines in a trace file */
+#define MAX_PLUGINS    8          /* allocator plugins that -A can load */
 #define LINENUM(i) (i+HDRLINES+1) /* cnvt trace request nums to linenums (origin 1) */
 
-#ifndef REF_ONLY
-#define REF_ONLY 0
+/* Version of the tree this was built from (written by the Makefile) */
+#if defined(__has_include)
+#if __has_include("buildid.h")
+#include "buildid.h"
+#endif
+#endif
+#ifndef BUILD_ID
+#define BUILD_ID ""
 #endif
 
+/* Version of mm-ref.c: bump it to invalidate the cached throughputs */
+#define REF_VERSION 1
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -58,32 +83,36 @@ typedef enum { WNONE, WALL, WUTIL, WPERF } weight_t;
  */
 
 /*
- * Records the extent of each block's payload.
- * Organized as doubly linked list
+ * The set of allocated payloads: a shadow bitmap of the heap, so that
+ * overlaps are found with word-wide bit operations, plus the ids of the
+ * allocated blocks, for the every-block checks of DBG_EXPENSIVE.
  */
-typedef struct range_t {
-    char *lo;              /* low payload address */
-    char *hi;              /* high payload address */
-    long index;            /* same index as free; for debugging */
-    struct range_t *next;
-    struct range_t *prev;
-} range_t;
+typedef struct {
+    shadow_t *shadow;
+    int *live;             /* ids of the allocated blocks, in no order */
+    int num_live;
+} range_set_t;
 
 /*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * Characterizes a single trace operation (allocator request).  This is
+ * also the record of a binary trace, which is replayed in place.
  */
-typedef struct {
-    range_t *list;
-    tree_t *lo_tree;
-} range_set_t;
+typedef tracebin_op_t traceop_t;
+enum { ALLOC = TRACE_ALLOC, FREE = TRACE_FREE, REALLOC = TRACE_REALLOC };
+
+/* Byte size of an alloc/realloc request of trace */
+#define OP_SIZE(trace, op) tracebin_size(op, (trace)->big)
 
-/* Characterizes a single trace operation (allocator request) */
+/*
+ * What the driver knows about one block id.  The fields are kept
+ * together so that a request touches one slot, not three arrays.
+ */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    long index;                         /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
+    char *ptr;            /* pointer returned by malloc/realloc */
+    size_t size;          /* payload size */
+    int rand_base;        /* index into random_data, if debug is on */
+    int live;             /* 1 + position in the range set's live ids, or 0 */
+} block_t;
 
 /* Holds the information for one trace file */
 typedef struct {
@@ -92,10 +121,11 @@ typedef struct {
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
-    traceop_t *ops;       /* array of requests */
-    char **blocks;        /* array of ptrs returned by malloc/realloc... */
-    size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
-    int *block_rand_base; /* index into random_data, if debug is on */
+    const traceop_t *ops; /* array of requests */
+    const uint64_t *big;  /* sizes of the requests too big to pack in ops */
+    const tracebin_hdr_t *map; /* mapped binary trace holding ops, or NULL */
+    size_t map_len;
+    block_t *blocks;      /* the block of each id */
 } trace_t;
 
 /*
@@ -108,6 +138,32 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+/* High-water marks kept while measuring space utilization */
+typedef struct {
+    size_t total_size;      /* payload bytes currently allocated */
+    size_t max_total_size;  /* peak of total_size */
+    size_t max_heap_size;   /* peak heap size */
+    long ops;               /* requests replayed so far */
+    struct frag *frag;      /* fragmentation samples (-F), or NULL */
+} util_t;
+
+/* Fragmentation metrics, each as a fraction of the heap (-F) */
+typedef enum {
+    FRAG_INTERNAL,  /* allocated blocks beyond their payload */
+    FRAG_SLACK,     /* usable bytes beyond the payload (part of internal) */
+    FRAG_EXTERNAL,  /* free bytes outside the largest free block */
+    FRAG_UNUSABLE,  /* free bytes in blocks too small for upcoming requests */
+    FRAG_METRICS
+} frag_metric_t;
+
+typedef struct frag {
+    long interval;              /* requests between samples */
+    size_t usable;              /* usable bytes of the live blocks */
+    long samples;
+    double sum[FRAG_METRICS];
+    double max[FRAG_METRICS];
+} frag_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -121,6 +177,13 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double events[FCYC_NUM_EVENTS]; /* hardware events per op (-1 if not measured) */
+    hist_t *latency[3]; /* latency of each request type in TSC ticks (or NULL) */
+    long frag_samples;  /* number of fragmentation samples (-F) */
+    double frag_max[FRAG_METRICS];  /* worst of each fragmentation metric */
+    double frag_mean[FRAG_METRICS]; /* mean of each fragmentation metric */
+    int bench_runs;     /* number of timings with -B */
+    double bench_kops[BENCH_MAX_RUNS]; /* throughput of each of them */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -138,14 +201,13 @@ typedef struct {
  * at a "random" place (a hash of the index), and copy random data
  * into it.  With DBG_CHEAP, we check that the data survived when we
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
- * randint_t should be a byte, in case students return unaligned memory.
+ * every operation.  The data is written and compared 64 bits at a
+ * time; random_data repeats its first word after the end, so that a
+ * word may be read at any offset below RANDOM_DATA_LEN.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
 
-typedef unsigned char randint_t;
-static const char randint_t_name[] = "byte";
-static randint_t random_data[RANDOM_DATA_LEN];
+static unsigned char random_data[RANDOM_DATA_LEN + sizeof(uint64_t)];
 
 
 /********************
@@ -155,18 +217,50 @@ static randint_t random_data[RANDOM_DATA_LEN];
 /* Global values */
 typedef enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode_t; 
 
-static debug_mode_t debug_mode = REF_ONLY ? DBG_NONE : DBG_CHEAP;
-int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
+static debug_mode_t debug_mode = DBG_CHEAP;
+int verbose = 1;                 /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static unsigned event_mask = 0;   /* Hardware events to report per op (-p) */
+static bool latency_mode = false; /* Report per-request latency percentiles */
 static size_t maxfill = MAXFILL;
+static int num_jobs = 0;          /* Replay on this many threads (-j) */
+static bool mix_traces = false;   /* Threads replay different traces (-M) */
+static bool stream_mode = false;  /* Replay traces from their files (-S) */
+static char *native_file = NULL;  /* Compiled trace to time (-X) */
+static int num_procs = 0;         /* Evaluate traces in this many processes (-P) */
+static FILE *timeline = NULL;     /* Utilization timeline CSV (-U) */
+static bool frag_mode = false;    /* Report fragmentation metrics (-F) */
+static char *plugin_files[MAX_PLUGINS]; /* Allocators to compare with mm.c (-A) */
+static int num_plugins = 0;
+
+/* The allocator under test: mm.c, or a plugin loaded with -A */
+static const mm_plugin_t builtin_mm = {
+    "mm", mm_init, mm_malloc, mm_free, mm_realloc, mm_malloc_usable_size,
+    mm_visit_free, mm_checkheap
+};
+static const mm_plugin_t *mm = &builtin_mm;
+static long timeline_interval = TIMELINE_INTERVAL; /* Requests between samples (-N) */
+static bool overlap_timing = false; /* With -P, let the timing runs overlap (-Q) */
+static int bench_runs = 0;        /* Time each trace this many times (-B) */
+static char *baseline_in = NULL;  /* Baseline to compare with (-C) */
+static char *baseline_out = NULL; /* Where to save the timings (-W) */
+static char *json_file = NULL;    /* Write the results as JSON (-J) */
+static FILE *json_stdout = NULL;  /* The real stdout, with -J - */
+static bool remeasure_ref = false; /* Time the reference again (-R) */
+static int pin_cpu = -1;          /* CPU the timing runs are pinned to (-b) */
+static double warmup_secs = 0;    /* Clock warm-up before timing (-w) */
+static bool discard_switches = false; /* Drop disturbed samples (-x) */
+static bool cold_cache = false;   /* Flush the caches before each run (-K) */
+static double ref_throughput = 0; /* Of the reference allocator, in Kops */
 
 /* by default, no timeouts */
 static int set_timeout = 0;
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
+static char ref_tracedir[MAXLINE] = TRACEDIR; /* The same, kept with -f, for the reference */
 
 /* The following are null-terminated lists of tracefiles that may or may not get used */
 
@@ -193,10 +287,11 @@ static sum_stats_t global_mm_sum_stats;
 static void add_tracefile(char *trace);
 
 /* these functions manipulate range sets */
-static range_set_t *new_range_set();
+static range_set_t *new_range_set(int num_ids);
+static void reset_range_set(range_set_t *ranges);
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index);
-static void remove_range(range_set_t *ranges, char *lo);
+                      trace_t *trace, int opnum, int index);
+static void remove_range(range_set_t *ranges, trace_t *trace, int index);
 static void free_range_set(range_set_t *ranges);
 
 /* These functions implement the debugging code */
@@ -217,11 +312,43 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static bool check_mm_ops(trace_t *trace, range_set_t *ranges,
+                         const traceop_t *ops, long n, long first);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
+static void measure_util(trace_t *trace, const traceop_t *ops, long n,
+                         util_t *util, int tracenum);
+static void open_timeline(const char *path);
+static void sample_timeline(const trace_t *trace, const util_t *util);
+static void start_frag(util_t *util, frag_t *frag, long num_ops);
+static void sample_frag(const trace_t *trace, const traceop_t *ops, long n,
+                        util_t *util);
+static void finish_frag(const frag_t *frag, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void replay_mm(trace_t *trace);
+static void replay_mm_ops(trace_t *trace, const traceop_t *ops, long n);
+static void stream_trace(stats_t *stats, const char *tracedir,
+                         const char *filename, int tracenum);
+static void eval_mm_latency(trace_t *trace, hist_t **latency);
+static void run_native(const char *path, int num_tracefiles, stats_t *mm_stats);
+static void run_plugins(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, stats_t *mm_stats,
+                        speed_t *speed_params);
+
+#ifdef THREAD_SAFE
+/* Replaying traces on several threads at once against mm.c */
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, stats_t *mm_stats);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printlatency(int n, stats_t *stats);
+static void printfrag(int n, stats_t *stats);
+static int printbench(int n, stats_t *stats);
+static void save_baseline(int n, stats_t *stats);
+static void write_json(int n, stats_t *stats, double util, double kops,
+                       const double score[3]);
+static bool read_cpu_type(char *cpu_type);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -242,6 +369,109 @@ static void timeout_handler(int sig __attribute__((unused))) {
 /* Compute throughput from reference implementation */
 static double measure_ref_throughput();
 
+/* Evaluating several traces at once in worker processes (-P) */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params);
+static void timing_begin(void);
+static void timing_end(void);
+
+/*
+ * record_events - Save the hardware events per op counted by the last
+ *    fsec, or -1 for events that were not counted.
+ */
+static void record_events(stats_t *stats, double ops)
+{
+    int e;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+        stats->events[e] = ops > 0 ? fsec_event(e) : -1;
+        if (stats->events[e] >= 0)
+            stats->events[e] /= ops;
+    }
+}
+
+/*
+ * run_test - Evaluate the mm package on trace i: check it, measure its
+ *    utilization, and time it.  Results go in *stats.
+ */
+static void run_test(int i, const char *tracedir, char **tracefiles,
+                     stats_t *stats, speed_t *speed_params) {
+    /* initialize simulated memory system in memlib.c *
+     * start each trace with a clean system */
+    mem_init();
+    if (stream_mode) {
+        timing_begin();
+        stream_trace(stats, tracedir, tracefiles[i], i);
+        timing_end();
+        mem_deinit();
+        return;
+    }
+    // NOTE: If times out, then it will reread the trace file 
+
+    trace_t *trace;
+    trace = read_trace(stats, tracedir, tracefiles[i]);
+    range_set_t *ranges = new_range_set(trace->num_ids);
+    strcpy(stats->filename, trace->filename);
+    stats->ops = trace->num_ops;
+
+    /* Prepare for timeout */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        stats->valid = false;
+    } else {
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness, ");
+        stats->valid =
+            /* Do 2 tests, since may fail to reinitialize properly */
+            eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
+
+        if (onetime_flag) {
+            free_trace(trace);
+            free_range_set(ranges);
+            return;
+        }
+    }
+    if (stats->valid) {
+        if (verbose > 1)
+            printf("efficiency, ");
+        stats->util = eval_mm_util(trace, i, stats);
+        speed_params->trace = trace;
+        speed_params->ranges = ranges;
+        if (verbose > 1)
+            printf("and performance.\n");
+        timing_begin();
+        stats->secs = fsec(eval_mm_speed, speed_params);
+        record_events(stats, trace->num_ops);
+        if (discard_switches && verbose > 1)
+            printf("Discarded %ld samples with context switches.\n",
+                   fsec_discarded());
+        if (bench_runs > 0) {
+            /* score the median of the timings */
+            double secs[BENCH_MAX_RUNS];
+            secs[0] = stats->secs;
+            for (int r = 1; r < bench_runs; r++)
+                secs[r] = fsec(eval_mm_speed, speed_params);
+            for (int r = 0; r < bench_runs; r++)
+                stats->bench_kops[r] = stats->ops * 1e-3 / secs[r];
+            stats->bench_runs = bench_runs;
+            stats->secs = bench_median(secs, bench_runs);
+        }
+        if (latency_mode) {
+            if (verbose > 1)
+                printf("Timing each request.\n");
+            for (int t = 0; t < 3; t++)
+                stats->latency[t] = hist_new();
+            eval_mm_latency(trace, stats->latency);
+        }
+        timing_end();
+    }
+
+    free_trace(trace);
+    free_range_set(ranges);
+
+    /* clean up memory system */
+    mem_deinit();
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
  * num_tracefiles, if there's a timeout)
@@ -249,58 +479,228 @@ static double measure_ref_throughput();
 static void run_tests(int num_tracefiles, const char *tracedir,
                       char **tracefiles, 
                       stats_t *mm_stats, speed_t *speed_params) {
-    volatile int i;
+    int i;
 
+    if (num_procs > 1 && !onetime_flag) {
+        run_tests_parallel(num_tracefiles, tracedir, tracefiles, mm_stats,
+                           speed_params);
+        return;
+    }
     for (i=0; i < num_tracefiles; i++) {
-        /* initialize simulated memory system in memlib.c *
-         * start each trace with a clean system */
-        mem_init();
-        range_set_t *ranges = new_range_set();
+        run_test(i, tracedir, tracefiles, &mm_stats[i], speed_params);
+        if (onetime_flag)
+            return;
+    }
+}
 
+/*
+ * With -P, each trace is evaluated by a forked worker with a heap of its
+ * own, at most num_procs at a time.  A worker sends back its stats_t,
+ * its error count and any latency histograms over a pipe.  The workers
+ * take turns for the timing runs, so that they do not slow each other
+ * down; checking and utilization still run in parallel.  With -Q, the
+ * timing runs overlap too, which is faster but skews the throughput.
+ */
+typedef struct {
+    stats_t stats;
+    int errors;
+    bool latency;           /* followed by the 3 latency histograms */
+} worker_result_t;
 
-        // NOTE: If times out, then it will reread the trace file 
+typedef struct {
+    pid_t pid;
+    int fd;
+    int trace;
+    char *buf;              /* what the worker sent so far */
+    size_t len, cap;
+} worker_t;
 
-        trace_t *trace;
-        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
-        strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+/* Serializes the timing runs of the workers, unless -Q */
+static pthread_mutex_t *timing_lock = NULL;
 
-        /* Prepare for timeout */
-        if (setjmp(timeout_jmpbuf) != 0) {
-            mm_stats[i].valid = false;
-        } else {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
-                /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
-
-            if (onetime_flag) {
-                free_trace(trace);
-                return;
-            }
-        }
-        if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
-            speed_params->trace = trace;
-            speed_params->ranges = ranges;
-            if (verbose > 1)
-                printf("and performance.\n");
-            mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+static void timing_begin(void)
+{
+    /* a worker that died holding the lock left nothing to clean up */
+    if (timing_lock != NULL && pthread_mutex_lock(timing_lock) == EOWNERDEAD)
+        pthread_mutex_consistent(timing_lock);
+}
+
+static void timing_end(void)
+{
+    if (timing_lock != NULL)
+        pthread_mutex_unlock(timing_lock);
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            unix_error("write to the driver failed");
+        p += n;
+        len -= n;
+    }
+}
+
+static void init_timing_lock(void)
+{
+    pthread_mutexattr_t attr;
+
+    timing_lock = mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (timing_lock == MAP_FAILED)
+        unix_error("mmap of the timing lock failed");
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(timing_lock, &attr) != 0)
+        app_error("cannot create the timing lock\n");
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Fork a worker to evaluate trace i */
+static void start_worker(worker_t *w, int i, const char *tracedir,
+                         char **tracefiles, speed_t *speed_params)
+{
+    worker_result_t result;
+    int fds[2];
+    int t;
+
+    if (pipe(fds) < 0)
+        unix_error("pipe failed in start_worker");
+    if ((w->pid = fork()) < 0)
+        unix_error("fork failed in start_worker");
+    if (w->pid == 0) {
+        close(fds[0]);
+        if (set_timeout > 0)
+            alarm(set_timeout);
+        memset(&result, 0, sizeof(result));
+        run_test(i, tracedir, tracefiles, &result.stats, speed_params);
+        result.errors = errors;
+        result.latency = result.stats.latency[0] != NULL;
+        write_all(fds[1], &result, sizeof(result));
+        if (result.latency)
+            for (t = 0; t < 3; t++)
+                write_all(fds[1], result.stats.latency[t], sizeof(hist_t));
+        _exit(0);
+    }
+    close(fds[1]);
+    w->fd = fds[0];
+    w->trace = i;
+    w->len = 0;
+}
+
+/* Collect the result of a worker that closed its pipe */
+static void finish_worker(worker_t *w, const char *tracedir,
+                          char **tracefiles, stats_t *mm_stats)
+{
+    worker_result_t *result = (worker_result_t *) w->buf;
+    stats_t *stats = &mm_stats[w->trace];
+    int status, t;
+
+    close(w->fd);
+    while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (w->len < sizeof(worker_result_t) ||
+        w->len != sizeof(worker_result_t) +
+                  (result->latency ? 3 * sizeof(hist_t) : 0)) {
+        snprintf(stats->filename, MAXLINE, "%s%s", tracedir,
+                 tracefiles[w->trace]);
+        stats->valid = false;
+        if (WIFSIGNALED(status))
+            printf("ERROR [trace %s]: worker killed by signal %d\n",
+                   stats->filename, WTERMSIG(status));
+        else
+            printf("ERROR [trace %s]: worker exited with status %d\n",
+                   stats->filename, WEXITSTATUS(status));
+        errors++;
+        return;
+    }
+    *stats = result->stats;
+    errors += result->errors;
+    for (t = 0; t < 3; t++) {
+        stats->latency[t] = NULL;
+        if (result->latency) {
+            stats->latency[t] = hist_new();
+            memcpy(stats->latency[t], w->buf + sizeof(worker_result_t) +
+                   t * sizeof(hist_t), sizeof(hist_t));
         }
+    }
+}
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
-        free_trace(trace);
-        free_range_set(ranges);
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = num_procs, running = 0, next = 0, i;
+    worker_t *workers;
+    struct pollfd *fds;
+
+    if (cores > 0 && max_workers > cores)
+        max_workers = cores;
+    if (max_workers > num_tracefiles)
+        max_workers = num_tracefiles;
+    if (!overlap_timing)
+        init_timing_lock();
+    workers = calloc(max_workers, sizeof(worker_t));
+    fds = calloc(max_workers, sizeof(struct pollfd));
+    if (workers == NULL || fds == NULL)
+        unix_error("calloc in run_tests_parallel failed");
+
+    /* the workers time themselves out */
+    alarm(0);
+    while (next < num_tracefiles || running > 0) {
+        while (running < max_workers && next < num_tracefiles)
+            start_worker(&workers[running++], next++, tracedir, tracefiles,
+                         speed_params);
+        for (i = 0; i < running; i++) {
+            fds[i].fd = workers[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, running, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll failed in run_tests_parallel");
+        }
+        for (i = running - 1; i >= 0; i--) {
+            worker_t *w = &workers[i];
+            ssize_t n;
+
+            if (fds[i].revents == 0)
+                continue;
+            if (w->cap - w->len < 4096) {
+                w->cap = w->cap ? 2 * w->cap : sizeof(worker_result_t) + 4096;
+                if ((w->buf = realloc(w->buf, w->cap)) == NULL)
+                    unix_error("realloc in run_tests_parallel failed");
+            }
+            if ((n = read(w->fd, w->buf + w->len, w->cap - w->len)) > 0) {
+                w->len += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            finish_worker(w, tracedir, tracefiles, mm_stats);
+            /* keep the running workers at the front */
+            char *buf = w->buf;
+            size_t cap = w->cap;
+            *w = workers[--running];
+            workers[running].buf = buf;
+            workers[running].cap = cap;
+        }
+    }
 
-        /* clean up memory system */
-        mem_deinit();
+    for (i = 0; i < max_workers; i++)
+        free(workers[i].buf);
+    free(workers);
+    free(fds);
+    if (timing_lock != NULL) {
+        pthread_mutex_destroy(timing_lock);
+        munmap(timing_lock, sizeof(pthread_mutex_t));
+        timing_lock = NULL;
     }
 }
 
@@ -338,6 +738,7 @@ int main(int argc, char **argv)
     double correctindex;
     double util_weight = 0, perf_weight = 0;
     int numcorrect;
+    int regressions = 0;       /* benchmark regressions against -C */
 
     setbuf(stdout, 0);
     setbuf(stderr, 0);
@@ -347,16 +748,12 @@ int main(int argc, char **argv)
     double min_throughput = 5000;
     double max_throughput = 10000;;
 
-
-#if !REF_ONLY
-
-    double ref_throughput;
-
     char c;
+    long mask;
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:j:X:P:p:U:N:A:B:C:W:J:b:w:hOVlDTHmMLSQFERxK")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -371,11 +768,12 @@ int main(int argc, char **argv)
                 break;
 
             case 't': /* Directory where the traces are located */
+                strcpy(ref_tracedir, optarg);
+                if (ref_tracedir[strlen(ref_tracedir)-1] != '/')
+                    strcat(ref_tracedir, "/"); /* path always ends with "/" */
                 if (num_global_tracefiles == 1) /* ignore if -f already encountered */
                     break;
-                strcpy(tracedir, optarg);
-                if (tracedir[strlen(tracedir)-1] != '/')
-                    strcat(tracedir, "/"); /* path always ends with "/" */
+                strcpy(tracedir, ref_tracedir);
                 break;
 
             case 'l': /* Run libc malloc */
@@ -406,6 +804,133 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'H': /* Back the heap with huge pages */
+                mem_set_pages(MEM_PAGES_HUGETLB);
+                break;
+
+            case 'E': /* Move heap data through mem_read/mem_write */
+                mem_set_copy(MEM_COPY_EMULATED);
+                break;
+
+            case 'm': /* Count dTLB misses during the timing runs */
+                event_mask |= 1u << FCYC_DTLB_MISSES;
+                set_fcyc_events(event_mask);
+                break;
+
+            case 'p': /* Count hardware events during the timing runs */
+                if ((mask = fcyc_parse_events(optarg)) < 0)
+                    app_error("unknown event in '%s'\n", optarg);
+                event_mask |= mask;
+                set_fcyc_events(event_mask);
+                break;
+
+            case 'S': /* Stream traces instead of loading them */
+                stream_mode = true;
+                break;
+
+            case 'L': /* Time every request and report tail latencies */
+                latency_mode = true;
+                break;
+
+            case 'j': /* Replay on several threads at once */
+                num_jobs = atoi(optarg);
+                if (num_jobs < 1)
+                    app_error("-j needs a positive number of threads");
+#ifndef THREAD_SAFE
+                app_error("-j needs a thread-safe allocator; build mdriver-mt");
+#endif
+                break;
+
+            case 'P': /* Evaluate traces in parallel worker processes */
+                num_procs = atoi(optarg);
+                if (num_procs < 1)
+                    app_error("-P needs a positive number of processes\n");
+                break;
+
+            case 'Q': /* With -P, let the timing runs overlap */
+                overlap_timing = true;
+                break;
+
+            case 'R': /* Time the reference allocator even if cached */
+                remeasure_ref = true;
+                break;
+
+            case 'b': /* Pin the timing runs to one CPU */
+                pin_cpu = atoi(optarg);
+                if (set_fcyc_cpu(pin_cpu) < 0)
+                    app_error("-b: cannot run on CPU %s\n", optarg);
+                break;
+
+            case 'w': /* Warm up the clock before timing */
+                warmup_secs = atof(optarg);
+                if (warmup_secs <= 0)
+                    app_error("-w needs a positive number of seconds\n");
+                set_fcyc_warmup(warmup_secs);
+                break;
+
+            case 'x': /* Discard samples with context switches */
+                discard_switches = true;
+                set_fcyc_discard_switches(1);
+                break;
+
+            case 'K': /* Time with cold caches */
+                cold_cache = true;
+                set_fcyc_cache_size(COLD_CACHE_BYTES);
+                set_fcyc_clear_cache(1);
+                break;
+
+            case 'F': /* Report internal and external fragmentation */
+                frag_mode = true;
+                break;
+
+            case 'B': /* Benchmark: time each trace several times */
+                bench_runs = atoi(optarg);
+                if (bench_runs < 2 || bench_runs > BENCH_MAX_RUNS)
+                    app_error("-B takes 2 to %d runs\n", BENCH_MAX_RUNS);
+                break;
+
+            case 'C': /* Compare with a benchmark baseline */
+                baseline_in = optarg;
+                break;
+
+            case 'W': /* Save the benchmark timings as a baseline */
+                baseline_out = optarg;
+                break;
+
+            case 'J': /* Write the results as JSON */
+                json_file = optarg;
+                if (strcmp(json_file, "-") == 0 && json_stdout == NULL) {
+                    /* keep stdout for the JSON alone */
+                    if ((json_stdout = fdopen(dup(STDOUT_FILENO), "w")) == NULL ||
+                        dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+                        unix_error("cannot redirect stdout for -J -");
+                }
+                break;
+
+            case 'U': /* Write a utilization timeline */
+                open_timeline(optarg);
+                break;
+
+            case 'N': /* Requests between timeline samples */
+                timeline_interval = atol(optarg);
+                if (timeline_interval < 1)
+                    app_error("-N needs a positive number of requests\n");
+                break;
+
+            case 'A': /* Compare with an allocator plugin */
+                if (num_plugins == MAX_PLUGINS)
+                    app_error("at most %d allocator plugins\n", MAX_PLUGINS);
+                plugin_files[num_plugins++] = optarg;
+                break;
+
+            case 'X': /* Time a trace compiled by rep2c */
+                native_file = optarg;
+                break;
+
+            case 'M': /* With -j, each thread replays a different trace */
+                mix_traces = true;
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -415,7 +940,17 @@ int main(int argc, char **argv)
                 exit(1);
         }
     }
-#endif /* !REF_ONLY */
+
+    if ((baseline_in != NULL || baseline_out != NULL) && bench_runs == 0)
+        app_error("-C and -W need -B\n");
+    if (overlap_timing && num_procs > 1) {
+        /* the workers on the pinned CPU must take turns */
+        if (pin_cpu >= 0)
+            app_error("-Q cannot be used with -b\n");
+        /* a baseline needs timings that did not compete for the CPUs */
+        if (baseline_out != NULL)
+            app_error("-W cannot be used with -P and -Q\n");
+    }
 
     if (num_global_tracefiles == 0) {
         int i;
@@ -457,6 +992,7 @@ int main(int argc, char **argv)
                 if (verbose > 1)
                     printf("and performance.\n");
                 libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                record_events(&libc_stats[i], trace->num_ops);
             }
             free_trace(trace);
         }
@@ -469,7 +1005,6 @@ int main(int argc, char **argv)
         }
     }
 
-#if !REF_ONLY
     /*
      * Get benchmark throughput
      */
@@ -483,8 +1018,6 @@ int main(int argc, char **argv)
 
     max_throughput = ref_throughput * MAX_SPEED_RATIO;
 
-#endif
-
     /*
      * Always run and evaluate the student's mm package
      */
@@ -499,6 +1032,15 @@ int main(int argc, char **argv)
     run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
               &speed_params);
 
+    if (verbose > 1) {
+        static const char *page_names[] = { "regular", "transparent huge", "hugetlb" };
+        printf("Heap backed by %s pages\n", page_names[mem_pages()]);
+        if (mem_pages() == MEM_PAGES_HUGETLB)
+            printf("First %zu MB of the heap from the hugetlb pool\n",
+                   mem_hugetlb_size() >> 20);
+        printf("Heap data moved with %s copies\n", mem_copy_name(mem_copy()));
+    }
+
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -514,8 +1056,29 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (latency_mode && verbose > 1)
+                printlatency(num_global_tracefiles, mm_stats);
+            if (frag_mode)
+                printfrag(num_global_tracefiles, mm_stats);
         }
     }
+    if (bench_runs > 0 && !onetime_flag) {
+        regressions = printbench(num_global_tracefiles, mm_stats);
+        if (baseline_out != NULL)
+            save_baseline(num_global_tracefiles, mm_stats);
+    }
+
+    if (num_plugins > 0 && !onetime_flag)
+        run_plugins(num_global_tracefiles, tracedir, global_tracefiles,
+                    mm_stats, &speed_params);
+
+    if (native_file != NULL && !onetime_flag)
+        run_native(native_file, num_global_tracefiles, mm_stats);
+
+#ifdef THREAD_SAFE
+    if (num_jobs > 0 && !onetime_flag)
+        run_scaling(num_global_tracefiles, tracedir, global_tracefiles, mm_stats);
+#endif
 
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
@@ -583,13 +1146,11 @@ int main(int argc, char **argv)
 
         perfindex = (p1 * UTIL_WEIGHT + p2 * (1.0 - UTIL_WEIGHT)) * 100.0;
 
-#if !REF_ONLY
         if (!tab_mode) {
             printf("Average utilization = %.1f%%. Average throughput = %.0f Kops/sec\n",
                    avg_mm_util * 100.0,
                    avg_mm_throughput);
         }
-#endif
     }
     else { /* There were errors */
         p1_checkpoint = 0.0;
@@ -603,9 +1164,6 @@ int main(int argc, char **argv)
         printf("Terminated with %d errors\n", errors);
     }
 
-#if REF_ONLY
-    printf("%.0f\n", avg_mm_throughput);
-#else /* !REF_ONLY */
     if (verbose > 0) {
         printf("\n");
         printf("***Checkpoint 1 correctness index = %.1f/50.0***\n",
@@ -640,9 +1198,15 @@ int main(int argc, char **argv)
            (int)ceil(correctindex),
            (int)ceil(perfindex_checkpoint),
            (int)ceil(perfindex));
-#endif
 
-    exit(0);
+    if (json_file != NULL && !onetime_flag) {
+        double score[3] = { correctindex, perfindex_checkpoint, perfindex };
+        write_json(num_global_tracefiles, mm_stats, avg_mm_util,
+                   avg_mm_throughput, score);
+    }
+
+    /* with -C, a regression fails the run */
+    exit(regressions > 0);
 }
 
 
@@ -658,30 +1222,47 @@ static void add_tracefile(char *trace) {
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range set, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks.
  ****************************************************************/
 
+#if ALIGNMENT % SHADOW_GRANULE != 0
+#error "payloads sharing a shadow granule would be reported as overlapping"
+#endif
+
 /*
- * new_range_set - Create an empty range set
+ * new_range_set - Create an empty range set for a trace of num_ids ids
  */
-static range_set_t *new_range_set() {
+static range_set_t *new_range_set(int num_ids) {
     range_set_t *ranges = (range_set_t *) malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    if (ranges == NULL ||
+        (ranges->live = malloc((num_ids + 1) * sizeof(int))) == NULL)
+        unix_error("malloc error in new_range_set");
+    ranges->shadow = shadow_new();
+    ranges->num_live = 0;
     return ranges;
 }
 
+/*
+ * reset_range_set - Empty the range set before a run from an empty heap
+ */
+static void reset_range_set(range_set_t *ranges)
+{
+    shadow_reset(ranges->shadow, mem_heap_lo());
+    ranges->num_live = 0;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we mark its payload in the shadow bitmap and add it to the live ids.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index) {
+                      trace_t *trace, int opnum, int index) {
     char *hi = lo + size - 1;
+    char *other;
 
     assert(size > 0);
 
@@ -701,73 +1282,42 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if (debug_mode == DBG_NONE) return 1;
-
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned) lo);
-    range_t *next = prev ? prev->next : NULL;
-    /* See if it overlaps previous or next blocks */
-    if (prev && lo <= prev->hi) {
-        malloc_error(trace, opnum,
-                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                     lo, hi, prev->lo, prev->hi);
-        return false;
-    }
-    if (next && hi >= next->lo) {
+    /* It must not overlap any allocated payload */
+    if ((other = shadow_mark(ranges->shadow, lo, size)) != NULL) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                     lo, hi, next->lo, next->hi);
+                     "Payload (%p:%p) overlaps another payload at %p\n",
+                     lo, hi, other);
         return false;
     }
-    /*
-     * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
-     */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->prev = prev;
-    if (prev)
-        prev->next = p;
-    else
-        ranges->list = p;
-    p->next = next;
-    if (next)
-        next->prev = p;
-    p->lo = lo;
-    p->hi = hi;
-    p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned) lo, (void *) p);
+    ranges->live[ranges->num_live++] = index;
+    trace->blocks[index].live = ranges->num_live;
     return true;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Forget the payload of block index, if it is allocated
  */
-static void remove_range(range_set_t *ranges, char *lo)
+static void remove_range(range_set_t *ranges, trace_t *trace, int index)
 {
-    range_t *p = (range_t *) tree_remove(ranges->lo_tree, (long unsigned) lo);
-    if (!p)
+    block_t *block = &trace->blocks[index];
+    if (block->live == 0)
         return;
-    range_t *prev = p->prev;
-    range_t *next = p->next;
-    if (prev)
-        prev->next = next;
-    else
-        ranges->list = next;
-    if (next)
-        next->prev = prev;
-    free(p);
+    shadow_unmark(ranges->shadow, block->ptr, block->size);
+
+    /* Move the last live id into its place */
+    int last = ranges->live[--ranges->num_live];
+    ranges->live[block->live - 1] = last;
+    trace->blocks[last].live = block->live;
+    block->live = 0;
 }
 
 /*
- * free_range_set - free all of the range records for a trace
+ * free_range_set - free the range set of a trace
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    shadow_free(ranges->shadow);
+    free(ranges->live);
     free(ranges);
 }
 
@@ -784,106 +1334,116 @@ static void init_random_data(void) {
     for(len = 0; len < RANDOM_DATA_LEN; ++len) {
         random_data[len] = random();
     }
+    memcpy(&random_data[RANDOM_DATA_LEN], random_data, sizeof(uint64_t));
 }
 
-static void randomize_block(trace_t *traces, int index) {
-    size_t size, fsize, fsize_end;
-    size_t i;
-    randint_t *block, *block_end;
-    int base;
+/*
+ * fill_extent - Of a payload of size bytes, random data goes in the
+ *     first *head bytes and the last *tail bytes: all of it if maxfill
+ *     is 0 or the payload is small, else maxfill bytes at each end.
+ */
+static void fill_extent(size_t size, size_t *head, size_t *tail) {
+    if (maxfill == 0 || size <= maxfill) {
+        *head = size;
+        *tail = 0;
+    } else {
+        *head = maxfill;
+        *tail = size > 2 * maxfill ? maxfill : size - maxfill;
+    }
+}
 
-    if (debug_mode == DBG_NONE) return;
+/* Write n bytes of random data, starting at offset base of random_data */
+static void fill_random(unsigned char *dst, size_t base, size_t n) {
+    size_t r = base % RANDOM_DATA_LEN;
 
-    traces->block_rand_base[index] = random();
+    while (n > 0) {
+        size_t len = n < RANDOM_DATA_LEN - r ? n : RANDOM_DATA_LEN - r;
+        mem_memcpy(dst, &random_data[r], len);
+        dst += len;
+        n -= len;
+        r = 0;
+    }
+}
 
-    block = (randint_t*)traces->blocks[index];
-    size = traces->block_sizes[index] / sizeof(*block);
-    if (size == 0)
-        return;
-    fsize = size;
-    if (fsize > maxfill) {
-        fsize = maxfill;
-        if (size > (2 * fsize)) {
-            fsize_end = fsize;
-            block_end = block + (size - fsize_end);
-        } else {
-            fsize_end = size - fsize;
-            block_end = block + fsize;
+/*
+ * compare_random - Compare n bytes at src with the random data from
+ *     offset base, a word at a time.  Returns the number of bytes that
+ *     differ, and the offset of the first of them in *first.
+ */
+static size_t compare_random(const unsigned char *src, size_t base, size_t n,
+                             size_t *first) {
+    size_t r = base % RANDOM_DATA_LEN;
+    size_t i, w, bad = 0;
+
+    for (i = 0; i < n; i += w) {
+        uint64_t want, diff;
+        w = n - i < sizeof(uint64_t) ? n - i : sizeof(uint64_t);
+        memcpy(&want, &random_data[r], sizeof(want));
+        diff = mem_read(src + i, w) ^ want;
+        if (w < sizeof(uint64_t))
+            diff &= ((uint64_t) 1 << (8 * w)) - 1;
+        if (diff != 0) {
+            /* one bit per differing byte */
+            diff |= diff >> 4;
+            diff |= diff >> 2;
+            diff |= diff >> 1;
+            diff &= 0x0101010101010101ull;
+            if (bad == 0)
+                *first = i + __builtin_ctzll(diff) / 8;
+            bad += __builtin_popcountll(diff);
         }
-    } else {
-        fsize_end = 0;
-        block_end = NULL;
+        r += w;
+        if (r >= RANDOM_DATA_LEN)
+            r -= RANDOM_DATA_LEN;
     }
-    base = traces->block_rand_base[index];
+    return bad;
+}
+
+static void randomize_block(trace_t *traces, int index) {
+    size_t size, head, tail;
+    unsigned char *block;
+    int base;
 
-    // NOTE: It's expensive to do this one byte at a time.
+    if (debug_mode == DBG_NONE) return;
 
-    // NOTE: It would be nice to also fill in at end of block, but
-    // this gets messy with REALLOC
+    traces->blocks[index].rand_base = random();
 
-    for(i = 0; i < fsize; i++) {
-        mem_write(&block[i],
-                  random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
-    for(i = 0; i < fsize_end; i++) {
-        mem_write(&block_end[i],
-                  random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
+    block = (unsigned char *)traces->blocks[index].ptr;
+    size = traces->blocks[index].size;
+    fill_extent(size, &head, &tail);
+    base = traces->blocks[index].rand_base;
+
+    fill_random(block, base, head);
+    fill_random(block + size - tail, base, tail);
 }
 
 static bool check_index(const trace_t *trace, int opnum, int index, int realloc) {
-    size_t size, fsize, fsize_end;
-    size_t i;
-    randint_t *block, *block_end;
+    size_t size, head, tail;
+    unsigned char *block;
     int base;
-    int ngarbled = 0;
-    int firstgarbled = -1;
+    size_t ngarbled, firstgarbled = 0;
 
     if (index < 0) return true; /* we're doing free(NULL) */
     if (debug_mode == DBG_NONE) return true;
 
-    block = (randint_t*)trace->blocks[index];
-    size = trace->block_sizes[index] / sizeof(*block);
-    if (size == 0)
-        return true;
-    fsize = size;
-    if (fsize > maxfill) {
-        fsize = maxfill;
-        if (size > (2 * fsize)) {
-            fsize_end = fsize;
-            block_end = block + (size - fsize_end);
-        } else {
-            fsize_end = size - fsize;
-            block_end = block + fsize;
-        }
-    } else {
-        fsize_end = 0;
-        block_end = NULL;
-    }
+    block = (unsigned char *)trace->blocks[index].ptr;
+    size = trace->blocks[index].size;
+    fill_extent(size, &head, &tail);
     if (realloc) { // skip check after realloc
-        fsize_end = 0;
+        tail = 0;
     }
-    base = trace->block_rand_base[index];
+    base = trace->blocks[index].rand_base;
 
-    // NOTE: It's expensive to do this one byte at a time.
-    for(i = 0; i < fsize; i++) {
-        if (mem_read(&block[i], sizeof(randint_t)) != random_data[(base + i) % RANDOM_DATA_LEN]) {
-            if (firstgarbled == -1) firstgarbled = i;
-            ngarbled++;
-        }
-    }
-    for(i = 0; i < fsize_end; i++) {
-        if (mem_read(&block_end[i], sizeof(randint_t)) != random_data[(base + i) % RANDOM_DATA_LEN]) {
-            if (firstgarbled == -1) firstgarbled = i;
-            ngarbled++;
-        }
+    ngarbled = compare_random(block, base, head, &firstgarbled);
+    if (ngarbled == 0) {
+        ngarbled = compare_random(block + size - tail, base, tail,
+                                  &firstgarbled);
+        firstgarbled += size - tail;
     }
     if (ngarbled != 0) {
-        malloc_error(trace, opnum, "block %d has %d garbled %s%s, "
-                     "starting at byte %zu", index, ngarbled, randint_t_name,
-                     ngarbled > 1 ? "s" : "", sizeof(randint_t) * firstgarbled);
+        malloc_error(trace, opnum, "block %d has %zu garbled byte%s, "
+                     "starting at byte %zu", index, ngarbled,
+                     ngarbled > 1 ? "s" : "", firstgarbled);
         return false;
     }
     return true;
@@ -893,20 +1453,96 @@ static bool check_index(const trace_t *trace, int opnum, int index, int realloc)
  * The following routines manipulate tracefiles
  *********************************************/
 
+static void alloc_blocks(trace_t *trace);
+
+/*
+ * map_binary_trace - if the trace file is in the binary format, map it
+ *      and use its records in place.  Returns false for a text trace.
+ */
+static bool map_binary_trace(trace_t *trace)
+{
+    const char *err;
+    const tracebin_hdr_t *hdr = tracebin_map(trace->filename, &trace->map_len, &err);
+
+    if (hdr == NULL) {
+        if (err != NULL)
+            app_error("%s: %s\n", trace->filename, err);
+        return false;
+    }
+    if (hdr->weight > 3u)
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    if (hdr->num_ops > INT_MAX || hdr->num_ids > INT_MAX)
+        app_error("%s: too many requests\n", trace->filename);
+    trace->map = hdr;
+    trace->weight = hdr->weight;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->data_bytes = hdr->data_bytes;
+    trace->ops = tracebin_ops(hdr);
+    trace->big = tracebin_big(hdr);
+    return true;
+}
+
+/*
+ * load_trace - read all the requests of a text trace into memory
+ */
+static void load_trace(trace_t *trace)
+{
+    tracestream_t *stream;
+    tracebin_hdr_t hdr;
+    const traceop_t *chunk;
+    const uint64_t *chunk_big;
+    const char *err;
+    traceop_t *ops;
+    uint64_t *big = NULL, num_big = 0, big_cap = 0;
+    size_t i, n;
+    int op_index = 0;
+    int max_index = -1;
+
+    if ((stream = tracestream_open(trace->filename, &hdr, &err)) == NULL)
+        app_error("%s: %s\n", trace->filename, err);
+    if (hdr.weight > 3u)
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    if (hdr.num_ops > INT_MAX || hdr.num_ids > INT_MAX)
+        app_error("%s: too many requests\n", trace->filename);
+    trace->weight = hdr.weight;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->data_bytes = hdr.data_bytes;
+
+    /* We'll store each request line in the trace in this array */
+    if ((ops =
+         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+
+    /* the stream numbers big sizes per chunk; renumber them for the trace */
+    while ((chunk = tracestream_next(stream, &n, &chunk_big)) != NULL) {
+        for (i = 0; i < n; i++, op_index++) {
+            if (!tracebin_pack(&ops[op_index], chunk[i].type, chunk[i].index,
+                               tracebin_size(&chunk[i], chunk_big),
+                               &big, &num_big, &big_cap))
+                unix_error("malloc failed in read_trace");
+            if (chunk[i].type != TRACE_FREE && chunk[i].index > max_index)
+                max_index = chunk[i].index;
+        }
+    }
+    if (!tracestream_close(stream, &err))
+        app_error("%s: %s\n", trace->filename, err);
+    if (max_index != trace->num_ids - 1)
+        app_error("%s: header says %d ids, requests use %d\n",
+                  trace->filename, trace->num_ids, max_index + 1);
+    assert(trace->num_ops == op_index);
+    trace->ops = ops;
+    trace->big = big;
+}
+
 /*
  * read_trace - read a trace file and store it in memory
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -915,107 +1551,54 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
+    /* Read the trace file header and requests */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL) {
-        unix_error("Could not open %s in read_trace", trace->filename);
-    }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore +=  fscanf(tracefile, "%d", &trace->num_ops);
-    ignore +=  fscanf(tracefile, "%zd", &trace->data_bytes);
+    trace->map = NULL;
+    if (!map_binary_trace(trace))
+        load_trace(trace);
+    alloc_blocks(trace);
 
-    if (((unsigned int)trace->weight) > 3u) {
-        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
-    }
+    /* fill in the stats */
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    stats->ops = trace->num_ops;
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    return trace;
+}
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
+/*
+ * alloc_blocks - allocate a slot for each block id of the trace
+ */
+static void alloc_blocks(trace_t *trace)
+{
     if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+         (block_t *)calloc(trace->num_ids, sizeof(block_t))) == NULL)
         unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
-
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-        switch(type[0]) {
-            case 'a':
-                ignore += fscanf(tracefile, "%u %lu", &index, &size);
-                trace->ops[op_index].type = ALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
-                max_index = (index > max_index) ? index : max_index;
-                break;
-            case 'r':
-                ignore += fscanf(tracefile, "%u %lu", &index, &size);
-                trace->ops[op_index].type = REALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
-                max_index = (index > max_index) ? index : max_index;
-                break;
-            case 'f':
-                ignore += fscanf(tracefile, "%u", &index);
-                trace->ops[op_index].type = FREE;
-                trace->ops[op_index].index = index;
-                break;
-            default:
-                app_error("Bogus type character (%c) in tracefile %s\n",
-                          type[0], trace->filename);
-        }
-        op_index++;
-        if (op_index == trace->num_ops) break;
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-
-    /* fill in the stats */
-    strcpy(stats->filename, trace->filename);
-    stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
-
-    return trace;
-}
+}
 
 /*
  * reinit_trace - get the trace ready for another run.
  */
 static void reinit_trace(trace_t *trace)
 {
+    /* rand_base is unused if size is zero */
     memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
-    memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
-    /* block_rand_base is unused if size is zero */
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record and the arrays it points to,
+ *              all of which were set up in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);
-    free(trace->block_sizes);
-    free(trace->block_rand_base);
+    if (trace->map != NULL) { /* unmap or free the requests... */
+        tracebin_unmap(trace->map, trace->map_len);
+    } else {
+        free((traceop_t *) trace->ops);
+        free((uint64_t *) trace->big);
+    }
+    free(trace->blocks);      /* the block slots... */
     free(trace);              /* and the trace record itself... */
 }
 
@@ -1029,127 +1612,134 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
-    int index;
-    size_t size;
-    char *newp;
-    char *oldp;
-    char *p;
-
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and empty the range set */
     mem_reset_brk();
     reinit_trace(trace);
+    reset_range_set(ranges);
 
     /* Call the mm package's init function */
-    if (!mm_init()) {
+    if (!mm->init()) {
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
 
-    /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+    return check_mm_ops(trace, ranges, trace->ops, trace->num_ops, 0);
+}
 
+/*
+ * check_mm_ops - Run n requests, the first of which is request first of
+ *    the trace, checking each block the mm package returns
+ */
+static bool check_mm_ops(trace_t *trace, range_set_t *ranges,
+                         const traceop_t *ops, long n, long first)
+{
+    long i;
+    int opnum;
+    int index;
+    size_t size;
+    char *newp;
+    char *oldp;
+    char *p;
+
+    /* Interpret each operation in the trace in order */
+    for (i = 0;  i < n;  i++) {
+        opnum = (int)(first + i);
+        index = ops[i].index;
+        size = OP_SIZE(trace, &ops[i]);
         if (debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
-            if (!mm_checkheap(0)) {
-                malloc_error(trace, i, "mm_checkheap returned false\n");
+            if (mm->checkheap != NULL && !mm->checkheap(0)) {
+                malloc_error(trace, opnum, "mm_checkheap returned false\n");
                 return false;
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r) {
-                if (!check_index(trace, i, r->index, 0))
+            for (int j = 0; j < ranges->num_live; j++)
+                if (!check_index(trace, opnum, ranges->live[j], 0))
                     return false;
-                r = r->next;
-            }
         }
 
-        switch (trace->ops[i].type) {
+        switch (ops[i].type) {
 
             case ALLOC: /* mm_malloc */
 
                 /* Call the student's malloc */
-                if ((p = mm_malloc(size)) == NULL) {
-                    malloc_error(trace, i, "mm_malloc failed.");
+                if ((p = mm->malloc(size)) == NULL) {
+                    malloc_error(trace, opnum, "mm_malloc failed.");
                     return false;
                 }
 
                 /*
                  * Test the range of the new block for correctness and add it
-                 * to the range list if OK. The block must be  be aligned properly,
+                 * to the range set if OK. The block must be  be aligned properly,
                  * and must not overlap any currently allocated block.
                  */
-                if (add_range(ranges, p, size, trace, i, index) == 0)
+                if (add_range(ranges, p, size, trace, opnum, index) == 0)
                     return false;
 
                 /* Remember region */
-                trace->blocks[index] = p;
-                trace->block_sizes[index] = size;
+                trace->blocks[index].ptr = p;
+                trace->blocks[index].size = size;
 
                 /* Set to random data, for debugging. */
                 randomize_block(trace, index);
                 break;
 
             case REALLOC: /* mm_realloc */
-                if (!check_index(trace, i, index, 0))
+                if (!check_index(trace, opnum, index, 0))
                     return false;
 
                 /* Call the student's realloc */
-                oldp = trace->blocks[index];
-                newp = mm_realloc(oldp, size);
+                oldp = trace->blocks[index].ptr;
+                newp = mm->realloc(oldp, size);
                 if ( (newp == NULL) && (size != 0) ) {
-                    malloc_error(trace, i, "mm_realloc failed.");
+                    malloc_error(trace, opnum, "mm_realloc failed.");
                     return false;
                 }
                 if ( (newp != NULL) && (size == 0) ) {
-                    malloc_error(trace, i, "mm_realloc with size 0 returned "
+                    malloc_error(trace, opnum, "mm_realloc with size 0 returned "
                                  "non-NULL.");
                     return false;
                 }
 
-                /* Remove the old region from the range list */
-                remove_range(ranges, oldp);
+                /* Remove the old region from the range set */
+                remove_range(ranges, trace, index);
 
-                /* Check new block for correctness and add it to range list */
+                /* Check new block for correctness and add it to range set */
                 if (size > 0) {
-                    if (add_range(ranges, newp, size, trace, i, index) == 0)
+                    if (add_range(ranges, newp, size, trace, opnum, index) == 0)
                         return false;
                 }
 
 
                 /* Move the region from where it was.
                  * Check up to min(size, oldsize) for correct copying. */
-                trace->blocks[index] = newp;
-                if (size < trace->block_sizes[index]) {
-                    trace->block_sizes[index] = size;
+                trace->blocks[index].ptr = newp;
+                if (size < trace->blocks[index].size) {
+                    trace->blocks[index].size = size;
                 }
                 // NOTE: Might help to pass old size here to check bytes at each end of allocation
 
-                if (!check_index(trace, i, index, 1))
+                if (!check_index(trace, opnum, index, 1))
                     return false;
-                trace->block_sizes[index] = size;
+                trace->blocks[index].size = size;
 
                 /* Set to random data, for debugging. */
                 randomize_block(trace, index);
                 break;
 
             case FREE: /* mm_free */
-                if (!check_index(trace, i, index, 0))
+                if (!check_index(trace, opnum, index, 0))
                     return false;
 
-                /* Remove region from list and call student's free function */
+                /* Remove region from set and call student's free function */
                 if (index == -1) {
                     p = 0;
                 } else {
-                    p = trace->blocks[index];
-                    remove_range(ranges, p);
+                    p = trace->blocks[index].ptr;
+                    remove_range(ranges, trace, index);
                 }
-                mm_free(p);
+                mm->free(p);
                 break;
 
             default:
@@ -1172,75 +1762,104 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
-    int index;
-    size_t size, newsize, oldsize;
-    size_t max_total_size = 0;
-    size_t total_size = 0;
-    size_t max_heap_size = 0;
-    size_t heap_size = 0;
-    char *p;
-    char *newp, *oldp;
+    util_t util = { 0, 0, 0, 0, NULL };
+    frag_t frag;
+
+    if (frag_mode)
+        start_frag(&util, &frag, trace->num_ops);
 
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!mm->init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    measure_util(trace, trace->ops, trace->num_ops, &util, tracenum);
+    if (timeline != NULL && util.ops % timeline_interval != 0)
+        sample_timeline(trace, &util);
+    if (frag_mode)
+        finish_frag(&frag, stats);
+
+    printf(".");
+
+    return ((double)util.max_total_size / (double)util.max_heap_size);
+}
+
+/*
+ * measure_util - Run n requests, keeping the high-water marks of the
+ *     payload and heap sizes
+ */
+static void measure_util(trace_t *trace, const traceop_t *ops, long n,
+                         util_t *util, int tracenum)
+{
+    long i;
+    int index;
+    size_t size, newsize, oldsize;
+    size_t heap_size = 0;
+    char *p;
+    char *newp, *oldp;
+
+    for (i = 0;  i < n;  i++) {
+        switch (ops[i].type) {
 
             case ALLOC: /* mm_alloc */
-                index = trace->ops[i].index;
-                size = trace->ops[i].size;
+                index = ops[i].index;
+                size = OP_SIZE(trace, &ops[i]);
 
-                if ((p = mm_malloc(size)) == NULL) {
+                if ((p = mm->malloc(size)) == NULL) {
                     app_error("trace %d: mm_malloc failed in eval_mm_util",
                               tracenum);
                 }
 
                 /* Remember region and size */
-                trace->blocks[index] = p;
-                trace->block_sizes[index] = size;
+                trace->blocks[index].ptr = p;
+                trace->blocks[index].size = size;
 
-                total_size += size;
+                util->total_size += size;
+                if (util->frag != NULL)
+                    util->frag->usable += mm->usable_size(p);
                 break;
 
             case REALLOC: /* mm_realloc */
-                index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
-                oldsize = trace->block_sizes[index];
-
-                oldp = trace->blocks[index];
-                if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
+                index = ops[i].index;
+                newsize = OP_SIZE(trace, &ops[i]);
+                oldsize = trace->blocks[index].size;
+
+                oldp = trace->blocks[index].ptr;
+                if (util->frag != NULL)
+                    util->frag->usable -= mm->usable_size(oldp);
+                if ((newp = mm->realloc(oldp,newsize)) == NULL && newsize != 0) {
                     app_error("trace %d: mm_realloc failed in eval_mm_util",
                               tracenum);
                 }
+                if (util->frag != NULL)
+                    util->frag->usable += mm->usable_size(newp);
 
                 /* Remember region and size */
-                trace->blocks[index] = newp;
-                trace->block_sizes[index] = newsize;
+                trace->blocks[index].ptr = newp;
+                trace->blocks[index].size = newsize;
 
-                total_size += (newsize - oldsize);
+                util->total_size += (newsize - oldsize);
                 break;
 
             case FREE: /* mm_free */
-                index = trace->ops[i].index;
+                index = ops[i].index;
                 if (index < 0) {
                     size = 0;
                     p = 0;
                 } else {
-                    size = trace->block_sizes[index];
-                    p = trace->blocks[index];
+                    size = trace->blocks[index].size;
+                    p = trace->blocks[index].ptr;
                 }
 
-                mm_free(p);
+                if (util->frag != NULL)
+                    util->frag->usable -= mm->usable_size(p);
+                mm->free(p);
 
-                total_size -= size;
+                util->total_size -= size;
                 break;
 
             default:
@@ -1249,18 +1868,153 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         }
 
         /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
+        util->max_total_size = (util->total_size > util->max_total_size) ?
+            util->total_size : util->max_total_size;
         heap_size = mem_heapsize();
-        max_heap_size = (heap_size > max_heap_size) ?
-            heap_size : max_heap_size;
+        util->max_heap_size = (heap_size > util->max_heap_size) ?
+            heap_size : util->max_heap_size;
+
+        if (++util->ops % timeline_interval == 0 && timeline != NULL)
+            sample_timeline(trace, util);
+        if (util->frag != NULL && util->ops % util->frag->interval == 0)
+            sample_frag(trace, &ops[i + 1], n - i - 1, util);
     }
+}
 
-#if !REF_ONLY
-    printf(".");
-#endif
+/*
+ * With -F, measure_util also splits the heap's overhead into internal
+ * fragmentation (allocated blocks beyond their payload, of which slack
+ * is the usable part) and external fragmentation (free bytes outside
+ * the largest free block, and free bytes in blocks too small, by
+ * mm_block_size(), for any of the next FRAG_LOOKAHEAD requests).  Each
+ * is sampled FRAG_SAMPLES times over the trace as a fraction of the
+ * heap; the worst and mean values are reported.
+ */
+typedef struct {
+    size_t need;        /* block for the smallest upcoming request */
+    size_t free_bytes;
+    size_t largest;
+    size_t unusable;
+} frag_summary_t;
 
-    return ((double)max_total_size / (double)max_heap_size);
+static void start_frag(util_t *util, frag_t *frag, long num_ops)
+{
+    memset(frag, 0, sizeof(*frag));
+    /* without these, the allocator gets no fragmentation samples */
+    if (mm->usable_size == NULL || mm->visit_free == NULL)
+        return;
+    frag->interval = num_ops / FRAG_SAMPLES > 0 ? num_ops / FRAG_SAMPLES : 1;
+    util->frag = frag;
+}
+
+static void summarize_frag(void *bp, size_t size, int size_class, void *arg)
+{
+    frag_summary_t *summary = arg;
+    summary->free_bytes += size;
+    if (size > summary->largest)
+        summary->largest = size;
+    /* need is SIZE_MAX when no allocation is coming */
+    if (size < summary->need && summary->need != SIZE_MAX)
+        summary->unusable += size;
+}
+
+/* Sample the heap; ops are the n requests still to come in this chunk */
+static void sample_frag(const trace_t *trace, const traceop_t *ops, long n,
+                        util_t *util)
+{
+    frag_t *frag = util->frag;
+    frag_summary_t summary = { SIZE_MAX, 0, 0, 0 };
+    double heap = mem_heapsize(), value[FRAG_METRICS];
+    long i;
+    int m;
+
+    if (heap == 0)
+        return;
+    for (i = 0; i < n && i < FRAG_LOOKAHEAD; i++) {
+        if (ops[i].type != FREE) {
+            size_t size = OP_SIZE(trace, &ops[i]);
+            if (size > 0 && size < summary.need)
+                summary.need = size;
+        }
+    }
+    /* free block sizes include the allocator's overhead, so compare them
+       with the block the request needs rather than its payload */
+    if (summary.need != SIZE_MAX)
+        summary.need = mm_block_size(summary.need);
+    mm->visit_free(summarize_frag, &summary);
+
+    value[FRAG_INTERNAL] = (heap - summary.free_bytes - util->total_size) / heap;
+    value[FRAG_SLACK] = (double) (frag->usable - util->total_size) / heap;
+    value[FRAG_EXTERNAL] = (summary.free_bytes - summary.largest) / heap;
+    value[FRAG_UNUSABLE] = summary.unusable / heap;
+    for (m = 0; m < FRAG_METRICS; m++) {
+        frag->sum[m] += value[m];
+        frag->max[m] = fmax(frag->max[m], value[m]);
+    }
+    frag->samples++;
+}
+
+static void finish_frag(const frag_t *frag, stats_t *stats)
+{
+    int m;
+    stats->frag_samples = frag->samples;
+    for (m = 0; m < FRAG_METRICS; m++) {
+        stats->frag_max[m] = frag->max[m];
+        stats->frag_mean[m] = frag->samples ? frag->sum[m] / frag->samples : 0;
+    }
+}
+
+/*
+ * With -U, measure_util writes a CSV line every timeline_interval
+ * requests (and at the end of the trace) with the payload bytes, the
+ * heap size, the free bytes on each of mm.c's free lists and the
+ * largest free block, so fragmentation can be followed through a trace.
+ */
+typedef struct {
+    size_t free_bytes[MM_NUM_CLASSES];
+    size_t total;
+    size_t largest;
+} free_summary_t;
+
+static void open_timeline(const char *path)
+{
+    int fd, c;
+
+    /* appending, so -P workers add whole lines without tearing them */
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0 ||
+        (timeline = fdopen(fd, "a")) == NULL)
+        unix_error("cannot open timeline %s", path);
+    setvbuf(timeline, NULL, _IOLBF, 0);
+    fprintf(timeline, "allocator,trace,op,payload_bytes,heap_bytes,free_bytes,largest_free");
+    for (c = 0; c < MM_NUM_CLASSES; c++)
+        fprintf(timeline, ",free_class%d", c);
+    fprintf(timeline, "\n");
+}
+
+static void summarize_free(void *bp, size_t size, int size_class, void *arg)
+{
+    free_summary_t *summary = arg;
+    if (size_class >= 0 && size_class < MM_NUM_CLASSES)
+        summary->free_bytes[size_class] += size;
+    summary->total += size;
+    if (size > summary->largest)
+        summary->largest = size;
+}
+
+static void sample_timeline(const trace_t *trace, const util_t *util)
+{
+    free_summary_t summary;
+    int c;
+
+    memset(&summary, 0, sizeof(summary));
+    if (mm->visit_free != NULL)
+        mm->visit_free(summarize_free, &summary);
+    fprintf(timeline, "%s,%s,%ld,%zu,%zu,%zu,%zu", mm->name, trace->filename,
+            util->ops,
+            util->total_size, mem_heapsize(), summary.total, summary.largest);
+    for (c = 0; c < MM_NUM_CLASSES; c++)
+        fprintf(timeline, ",%zu", summary.free_bytes[c]);
+    fprintf(timeline, "\n");
 }
 
 
@@ -1270,53 +2024,641 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!mm->init())
         app_error("mm_init failed in eval_mm_speed");
 
+    replay_mm(trace);
+}
+
+/*
+ * replay_mm - Run every request of the trace against an initialized
+ *    mm package, without any checking.
+ */
+static void replay_mm(trace_t *trace)
+{
+    replay_mm_ops(trace, trace->ops, trace->num_ops);
+}
+
+/* replay_mm_ops - Run n requests of the trace, starting at ops */
+static void replay_mm_ops(trace_t *trace, const traceop_t *ops, long n)
+{
+    long i;
+    int index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = 0;  i < n;  i++)
+        switch (ops[i].type) {
 
             case ALLOC: /* mm_malloc */
-                index = trace->ops[i].index;
-                size = trace->ops[i].size;
-                if ((p = mm_malloc(size)) == NULL)
-                    app_error("mm_malloc error in eval_mm_speed");
-                trace->blocks[index] = p;
+                index = ops[i].index;
+                size = OP_SIZE(trace, &ops[i]);
+                if ((p = mm->malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_mm");
+                trace->blocks[index].ptr = p;
                 break;
 
             case REALLOC: /* mm_realloc */
-                index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
-                oldp = trace->blocks[index];
-                if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-                    app_error("mm_realloc error in eval_mm_speed");
-                trace->blocks[index] = newp;
+                index = ops[i].index;
+                newsize = OP_SIZE(trace, &ops[i]);
+                oldp = trace->blocks[index].ptr;
+                if ((newp = mm->realloc(oldp,newsize)) == NULL && newsize != 0)
+                    app_error("mm_realloc error in replay_mm");
+                trace->blocks[index].ptr = newp;
                 break;
 
             case FREE: /* mm_free */
-                index = trace->ops[i].index;
+                index = ops[i].index;
                 if (index < 0) {
                     block = 0;
                 } else {
-                    block = trace->blocks[index];
+                    block = trace->blocks[index].ptr;
                 }
-                mm_free(block);
+                mm->free(block);
                 break;
 
             default:
-                app_error("Nonexistent request type in eval_mm_speed");
+                app_error("Nonexistent request type in replay_mm");
         }
 }
 
+/* The last component of a path */
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/*
+ * run_plugins - With -A, run each allocator plugin over the same traces
+ *    as mm.c, with the same checks, utilization accounting and timing,
+ *    then print utilization and throughput side by side.  Errors in a
+ *    plugin do not count against mm.c.
+ */
+static void run_plugins(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, stats_t *mm_stats,
+                        speed_t *speed_params)
+{
+    const char *labels[MAX_PLUGINS + 1];
+    stats_t *stats[MAX_PLUGINS + 1];
+    int plugin_errors[MAX_PLUGINS + 1];
+    int saved_errors = errors;
+    int i, k, n = num_plugins + 1;
+
+    labels[0] = "mm.c";
+    stats[0] = mm_stats;
+    plugin_errors[0] = errors;
+    for (k = 1; k < n; k++) {
+        char file[MAXLINE];
+        void *handle;
+        const mm_plugin_t *plugin;
+        sum_stats_t sum;
+
+        /* like -f, a bare name is relative to the current directory */
+        snprintf(file, sizeof(file), "%s%s",
+                 strchr(plugin_files[k - 1], '/') ? "" : "./",
+                 plugin_files[k - 1]);
+        if ((handle = dlopen(file, RTLD_NOW | RTLD_LOCAL)) == NULL)
+            app_error("%s\n", dlerror());
+        plugin = dlsym(handle, MM_PLUGIN_SYMBOL);
+        if (plugin == NULL || plugin->init == NULL || plugin->malloc == NULL ||
+            plugin->free == NULL || plugin->realloc == NULL)
+            app_error("%s: not an allocator plugin\n", file);
+        labels[k] = base_name(plugin_files[k - 1]);
+        if ((stats[k] = calloc(num_tracefiles, sizeof(stats_t))) == NULL)
+            unix_error("calloc in run_plugins failed");
+
+        if (verbose > 1)
+            printf("\nTesting %s (%s)\n", plugin->name, file);
+        errors = 0;
+        mm = plugin;
+        run_tests(num_tracefiles, tracedir, tracefiles, stats[k], speed_params);
+        mm = &builtin_mm;
+        plugin_errors[k] = errors;
+        if (verbose) {
+            printf("\nResults for %s (%s):\n", plugin->name, labels[k]);
+            printresults(num_tracefiles, stats[k], &sum);
+            printf("\n");
+        }
+        /* the handle stays open: stats may point into the plugin */
+    }
+    errors = saved_errors;
+
+    printf("Comparison of allocators (util %%, Kops):\n");
+    for (k = 0; k < n; k++)
+        printf(tab_mode ? "%s util\t%s Kops\t" : "%22s ", labels[k], labels[k]);
+    printf("%strace\n", tab_mode ? "" : " ");
+    for (i = 0; i < num_tracefiles; i++) {
+        for (k = 0; k < n; k++) {
+            const stats_t *st = &stats[k][i];
+            if (!st->valid)
+                printf(tab_mode ? "\t\t" : "%15s%7s ", "--", "--");
+            else
+                printf(tab_mode ? "%.1f\t%.0f\t" : "%14.1f%%%7.0f ",
+                       st->util * 100, st->ops * 1e-3 / st->secs);
+        }
+        printf("%s%s\n", tab_mode ? "" : " ", mm_stats[i].filename);
+    }
+    /* averaged like printresults, over the traces each one passed */
+    for (k = 0; k < n; k++) {
+        double util = 0, ops = 0, secs = 0;
+        int nutil = 0;
+        for (i = 0; i < num_tracefiles; i++) {
+            const stats_t *st = &stats[k][i];
+            if (!st->valid)
+                continue;
+            if (st->weight == WALL || st->weight == WUTIL) {
+                util += st->util;
+                nutil++;
+            }
+            if (st->weight == WALL || st->weight == WPERF) {
+                ops += st->ops;
+                secs += st->secs;
+            }
+        }
+        printf(tab_mode ? "%.1f\t%.0f\t" : "%14.1f%%%7.0f ",
+               nutil ? util / nutil * 100 : 0, secs > 0 ? ops * 1e-3 / secs : 0);
+    }
+    printf("%saverage\n", tab_mode ? "" : " ");
+    for (k = 1; k < n; k++)
+        if (plugin_errors[k] > 0)
+            printf("%s: %d errors\n", labels[k], plugin_errors[k]);
+    printf("\n");
+    for (k = 1; k < n; k++)
+        free(stats[k]);
+}
+
+/* Turns each of the compiled and interpreted replays is timed (-X) */
+#define NATIVE_ROUNDS 3
+
+/* A compiled trace and its block array, for fcyc */
+typedef struct {
+    const native_trace_t *trace;
+    void **blocks;
+} native_t;
+
+/*
+ * eval_native_speed - Like eval_mm_speed, for a trace compiled to
+ *    straight-line calls by rep2c
+ */
+static void eval_native_speed(void *ptr)
+{
+    native_t *native = ptr;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_native_speed");
+    native->trace->run(native->blocks);
+}
+
+/*
+ * run_native - With -X, time the replay of a trace compiled by rep2c,
+ *    which makes its requests without any interpretation, and compare
+ *    it with the interpreted replay of the same trace if it was run.
+ *    The interpreted replay is timed again, taking turns with the
+ *    compiled one on the same heap, so both see the same conditions.
+ */
+static void run_native(const char *path, int num_tracefiles, stats_t *mm_stats)
+{
+    char file[MAXLINE];
+    const native_trace_t *trace;
+    const stats_t *interp = NULL;
+    native_t native;
+    speed_t speed_params;
+    stats_t interp_stats;
+    void *handle;
+    double secs = DBL_MAX, kops, interp_secs = DBL_MAX;
+    int i, r;
+
+    /* like -f, a bare name is relative to the current directory */
+    snprintf(file, sizeof(file), "%s%s", strchr(path, '/') ? "" : "./", path);
+    if ((handle = dlopen(file, RTLD_NOW)) == NULL)
+        app_error("%s\n", dlerror());
+    if ((trace = dlsym(handle, NATIVE_TRACE_SYMBOL)) == NULL)
+        app_error("%s: not a trace compiled by rep2c\n", file);
+
+    for (i = 0; i < num_tracefiles; i++)
+        if (strcmp(base_name(mm_stats[i].filename), base_name(trace->trace)) == 0)
+            interp = &mm_stats[i];
+    if (interp != NULL && !interp->valid) {
+        printf("Not timing %s: %s failed the correctness checks\n", file,
+               interp->filename);
+        dlclose(handle);
+        return;
+    }
+
+    if ((native.blocks = calloc(trace->num_ids ? trace->num_ids : 1,
+                                sizeof(void *))) == NULL)
+        unix_error("calloc in run_native failed");
+    native.trace = trace;
+    mem_init();
+    if (interp != NULL) {
+        speed_params.trace = read_trace(&interp_stats, "", interp->filename);
+        speed_params.ranges = NULL;
+    }
+    for (r = 0; r < NATIVE_ROUNDS; r++) {
+        if (interp != NULL)
+            interp_secs = fmin(interp_secs, fsec(eval_mm_speed, &speed_params));
+        secs = fmin(secs, fsec(eval_native_speed, &native));
+    }
+    if (interp != NULL)
+        free_trace(speed_params.trace);
+    mem_deinit();
+    kops = trace->num_ops * 1e-3 / secs;
+
+    if (interp != NULL) {
+        double interp_kops = interp->ops * 1e-3 / interp_secs;
+        printf("Compiled replay of %s: %.0f Kops/sec, interpreted %.0f Kops/sec"
+               " (%.2fx)\n", trace->trace, kops, interp_kops, kops / interp_kops);
+    } else {
+        printf("Compiled replay of %s (unchecked): %.0f Kops/sec\n",
+               trace->trace, kops);
+    }
+    free(native.blocks);
+    dlclose(handle);
+}
+
+/* Seconds on the monotonic clock */
+static double wall_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * stream_trace - With -S, replay a trace straight from its file in
+ *    chunks instead of loading it, so its length does not matter.  A
+ *    first pass checks the blocks like eval_mm_valid, a second one
+ *    measures space utilization and a third one throughput; only the
+ *    replay of each chunk is timed.
+ */
+static void stream_trace(stats_t *stats, const char *tracedir,
+                         const char *filename, int tracenum)
+{
+    trace_t *trace;
+    tracestream_t *stream;
+    tracebin_hdr_t hdr;
+    const traceop_t *ops;
+    const char *err;
+    range_set_t *ranges = NULL;
+    util_t util = { 0, 0, 0, 0, NULL };
+    frag_t frag;
+    double secs = 0, start;
+    size_t n;
+    long done;
+    int pass;
+    bool valid = true;
+
+    if (verbose > 1)
+        printf("Streaming tracefile: %s\n", filename);
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
+        unix_error("calloc failed in stream_trace");
+    strcpy(trace->filename, tracedir);
+    strcat(trace->filename, filename);
+
+    for (pass = 0; pass < 3 && valid; pass++) {
+        if ((stream = tracestream_open(trace->filename, &hdr, &err)) == NULL)
+            app_error("%s: %s\n", trace->filename, err);
+        if (pass == 0) {
+            if (hdr.weight > 3u)
+                app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+            if (hdr.num_ids > INT_MAX)
+                app_error("%s: too many block ids\n", trace->filename);
+            trace->weight = hdr.weight;
+            trace->num_ids = hdr.num_ids;
+            trace->data_bytes = hdr.data_bytes;
+            alloc_blocks(trace);
+            ranges = new_range_set(trace->num_ids);
+        }
+        if (pass == 1 && frag_mode)
+            start_frag(&util, &frag, hdr.num_ops);
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (pass == 0)
+            reset_range_set(ranges);
+        if (!mm->init()) {
+            if (pass > 0)
+                app_error("trace %d: mm_init failed in stream_trace", tracenum);
+            malloc_error(trace, 0, "mm_init failed.");
+            valid = false;
+        }
+
+        done = 0;
+        while (valid && (ops = tracestream_next(stream, &n, &trace->big)) != NULL) {
+            if (pass == 0) {
+                valid = check_mm_ops(trace, ranges, ops, n, done);
+                done += n;
+            } else if (pass == 1) {
+                measure_util(trace, ops, n, &util, tracenum);
+            } else {
+                start = wall_secs();
+                replay_mm_ops(trace, ops, n);
+                secs += wall_secs() - start;
+            }
+        }
+        if (!tracestream_close(stream, &err))
+            app_error("%s: %s\n", trace->filename, err);
+        trace->big = NULL;  /* owned by the stream */
+        if (pass == 1 && timeline != NULL && util.ops % timeline_interval != 0)
+            sample_timeline(trace, &util);
+        util.frag = NULL;
+    }
+    printf(".");
+
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    stats->ops = hdr.num_ops;
+    stats->valid = valid;
+    if (valid) {
+        stats->util = (double)util.max_total_size / (double)util.max_heap_size;
+        stats->secs = secs;
+        record_events(stats, 0);
+        if (frag_mode)
+            finish_frag(&frag, stats);
+    }
+    free_range_set(ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_latency - Replay the trace until at least LATENCY_MIN_OPS
+ *    requests have been timed, timing each one with the time stamp
+ *    counter.  The cost of reading the counter itself is subtracted.
+ */
+static void eval_mm_latency(trace_t *trace, hist_t **latency)
+{
+    int i, index, rep, reps;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+    uint64_t start, end, overhead = UINT64_MAX;
+
+    for (i = 0; i < 1000; i++) {
+        start = read_tsc();
+        end = read_tsc();
+        if (end - start < overhead)
+            overhead = end - start;
+    }
+
+    reps = trace->num_ops > 0 ? (LATENCY_MIN_OPS + trace->num_ops - 1) / trace->num_ops : 1;
+    for (rep = 0; rep < reps; rep++) {
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (!mm->init())
+            app_error("mm_init failed in eval_mm_latency");
+
+        for (i = 0;  i < trace->num_ops;  i++) {
+            switch (trace->ops[i].type) {
+
+                case ALLOC: /* mm_malloc */
+                    index = trace->ops[i].index;
+                    size = OP_SIZE(trace, &trace->ops[i]);
+                    start = read_tsc();
+                    p = mm->malloc(size);
+                    end = read_tsc();
+                    if (p == NULL)
+                        app_error("mm_malloc error in eval_mm_latency");
+                    trace->blocks[index].ptr = p;
+                    break;
+
+                case REALLOC: /* mm_realloc */
+                    index = trace->ops[i].index;
+                    newsize = OP_SIZE(trace, &trace->ops[i]);
+                    oldp = trace->blocks[index].ptr;
+                    start = read_tsc();
+                    newp = mm->realloc(oldp,newsize);
+                    end = read_tsc();
+                    if (newp == NULL && newsize != 0)
+                        app_error("mm_realloc error in eval_mm_latency");
+                    trace->blocks[index].ptr = newp;
+                    break;
+
+                case FREE: /* mm_free */
+                    index = trace->ops[i].index;
+                    if (index < 0) {
+                        block = 0;
+                    } else {
+                        block = trace->blocks[index].ptr;
+                    }
+                    start = read_tsc();
+                    mm->free(block);
+                    end = read_tsc();
+                    break;
+
+                default:
+                    app_error("Nonexistent request type in eval_mm_latency");
+            }
+            end -= start;
+            hist_add(latency[trace->ops[i].type], end > overhead ? end - overhead : 0);
+        }
+    }
+}
+
+#ifdef THREAD_SAFE
+/*
+ * The scaling runs keep a pool of replay threads parked on a barrier.
+ * Each call of eval_mm_speed_mt resets the heap, releases the pool, and
+ * returns once every thread has replayed its private copy of a trace.
+ * fsec uses the CPU time of the calling thread, which sleeps meanwhile,
+ * so these runs are timed on the wall clock by time_pool instead.
+ */
+#define SCALING_MIN_SECS 0.01 /* time batches of calls at least this long */
+#define SCALING_SAMPLES  5    /* and keep the fastest of this many */
+
+typedef struct {
+    int nthreads;
+    struct replay_thread *threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    bool quit;
+} replay_pool_t;
+
+typedef struct replay_thread {
+    pthread_t tid;
+    replay_pool_t *pool;
+    trace_t *trace;       /* private copy of the trace replayed by this thread */
+    double secs;          /* fastest replay seen by this thread */
+} replay_thread_t;
+
+static void *replay_worker(void *arg)
+{
+    replay_thread_t *self = arg;
+    replay_pool_t *pool = self->pool;
+
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit)
+            return NULL;
+        double start = wall_secs();
+        replay_mm(self->trace);
+        double secs = wall_secs() - start;
+        if (self->secs == 0 || secs < self->secs)
+            self->secs = secs;
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+static void eval_mm_speed_mt(void *ptr)
+{
+    replay_pool_t *pool = ptr;
+    int i;
+
+    for (i = 0; i < pool->nthreads; i++)
+        reinit_trace(pool->threads[i].trace);
+    mem_reset_brk();
+    if (!mm->init())
+        app_error("mm_init failed in eval_mm_speed_mt");
+
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+}
+
+/* Wall time of one eval_mm_speed_mt call, best of SCALING_SAMPLES */
+static double time_pool(replay_pool_t *pool)
+{
+    long reps = 1, r;
+    double start, secs, best = DBL_MAX;
+    int k;
+
+    for (;;) {
+        start = wall_secs();
+        for (r = 0; r < reps; r++)
+            eval_mm_speed_mt(pool);
+        if (wall_secs() - start >= SCALING_MIN_SECS)
+            break;
+        reps += reps;
+    }
+    for (k = 0; k < SCALING_SAMPLES; k++) {
+        start = wall_secs();
+        for (r = 0; r < reps; r++)
+            eval_mm_speed_mt(pool);
+        secs = (wall_secs() - start) / reps;
+        best = fmin(best, secs);
+    }
+    return best;
+}
+
+/*
+ * time_threads - Replay trace first (and the traces after it with -M)
+ *    on nthreads threads at once.  Returns the wall time of one run and
+ *    fills in the per-thread throughput in Kops/s.
+ */
+static double time_threads(int nthreads, int first, int num_tracefiles,
+                           const char *tracedir, char **tracefiles,
+                           double *thread_kops, double *total_ops)
+{
+    replay_pool_t pool;
+    stats_t stats;
+    double secs;
+    int i;
+
+    pool.nthreads = nthreads;
+    pool.quit = false;
+    pool.threads = calloc(nthreads, sizeof(replay_thread_t));
+    if (pool.threads == NULL)
+        unix_error("calloc in time_threads failed");
+    if (pthread_barrier_init(&pool.start, NULL, nthreads + 1) != 0 ||
+        pthread_barrier_init(&pool.done, NULL, nthreads + 1) != 0)
+        unix_error("pthread_barrier_init in time_threads failed");
+
+    mem_init();
+    *total_ops = 0;
+    for (i = 0; i < nthreads; i++) {
+        int t = mix_traces ? (first + i) % num_tracefiles : first;
+        pool.threads[i].pool = &pool;
+        pool.threads[i].trace = read_trace(&stats, tracedir, tracefiles[t]);
+        *total_ops += pool.threads[i].trace->num_ops;
+        if (pthread_create(&pool.threads[i].tid, NULL, replay_worker,
+                           &pool.threads[i]) != 0)
+            unix_error("pthread_create in time_threads failed");
+    }
+
+    secs = time_pool(&pool);
+
+    pool.quit = true;
+    pthread_barrier_wait(&pool.start);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(pool.threads[i].tid, NULL);
+        thread_kops[i] = pool.threads[i].trace->num_ops * 1e-3 / pool.threads[i].secs;
+        free_trace(pool.threads[i].trace);
+    }
+    pthread_barrier_destroy(&pool.start);
+    pthread_barrier_destroy(&pool.done);
+    free(pool.threads);
+    mem_deinit();
+    return secs;
+}
+
+/*
+ * run_scaling - For each trace that passed the correctness checks,
+ *    compare replaying it on one thread with replaying num_jobs copies
+ *    (or num_jobs different traces, with -M) concurrently.
+ */
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, stats_t *mm_stats)
+{
+    double *thread_kops = calloc(num_jobs, sizeof(double));
+    double sum_one = 0, sum_many = 0;
+    int i, j, n = 0;
+
+    if (thread_kops == NULL)
+        unix_error("calloc in run_scaling failed");
+
+    if (verbose) {
+        printf("\nScaling of mm malloc with %d threads%s:\n", num_jobs,
+               mix_traces ? " (mixed traces)" : "");
+        if (tab_mode)
+            printf("1-thr Kops\tKops\tmin Kops/thr\tmax Kops/thr\tefficiency\ttrace\n");
+        else
+            printf("%11s%10s%14s%14s%7s  %s\n", "1-thr Kops", "Kops",
+                   "min Kops/thr", "max Kops/thr", "eff", "trace");
+    }
+    for (i = 0; i < num_tracefiles; i++) {
+        double ops, secs_one, secs_many, kops_one, kops_many;
+        double min_kops = DBL_MAX, max_kops = 0;
+
+        if (!mm_stats[i].valid || mm_stats[i].weight == WNONE ||
+            mm_stats[i].weight == WUTIL)
+            continue;
+        secs_one = time_threads(1, i, num_tracefiles, tracedir, tracefiles,
+                                thread_kops, &ops);
+        kops_one = ops * 1e-3 / secs_one;
+        secs_many = time_threads(num_jobs, i, num_tracefiles, tracedir,
+                                 tracefiles, thread_kops, &ops);
+        kops_many = ops * 1e-3 / secs_many;
+        for (j = 0; j < num_jobs; j++) {
+            min_kops = fmin(min_kops, thread_kops[j]);
+            max_kops = fmax(max_kops, thread_kops[j]);
+        }
+        sum_one += kops_one;
+        sum_many += kops_many;
+        n++;
+
+        if (!verbose)
+            continue;
+        if (tab_mode)
+            printf("%.0f\t%.0f\t%.0f\t%.0f\t%.2f\t%s\n", kops_one, kops_many,
+                   min_kops, max_kops, kops_many / (num_jobs * kops_one),
+                   mm_stats[i].filename);
+        else
+            printf("%11.0f%10.0f%14.0f%14.0f%7.2f  %s\n", kops_one, kops_many,
+                   min_kops, max_kops, kops_many / (num_jobs * kops_one),
+                   mm_stats[i].filename);
+    }
+    if (verbose && n > 0 && !tab_mode)
+        printf("Average: 1 thread = %.0f Kops/sec, %d threads = %.0f Kops/sec,"
+               " efficiency = %.2f\n", sum_one / n, num_jobs, sum_many / n,
+               sum_many / (num_jobs * sum_one));
+    free(thread_kops);
+}
+#endif /* THREAD_SAFE */
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1335,26 +2677,26 @@ static bool eval_libc_valid(trace_t *trace)
         switch (trace->ops[i].type) {
 
             case ALLOC: /* malloc */
-                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                if ((p = malloc(OP_SIZE(trace, &trace->ops[i]))) == NULL) {
                     malloc_error(trace, i, "libc malloc failed");
                     unix_error("System message");
                 }
-                trace->blocks[trace->ops[i].index] = p;
+                trace->blocks[trace->ops[i].index].ptr = p;
                 break;
 
             case REALLOC: /* realloc */
-                newsize = trace->ops[i].size;
-                oldp = trace->blocks[trace->ops[i].index];
+                newsize = OP_SIZE(trace, &trace->ops[i]);
+                oldp = trace->blocks[trace->ops[i].index].ptr;
                 if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
                     malloc_error(trace, i, "libc realloc failed");
                     unix_error("System message");
                 }
-                trace->blocks[trace->ops[i].index] = newp;
+                trace->blocks[trace->ops[i].index].ptr = newp;
                 break;
 
             case FREE: /* free */
                 if (trace->ops[i].index >= 0) {
-                    free(trace->blocks[trace->ops[i].index]);
+                    free(trace->blocks[trace->ops[i].index].ptr);
                 } else {
                     free(0);
                 }
@@ -1387,26 +2729,26 @@ static void eval_libc_speed(void *ptr)
         switch (trace->ops[i].type) {
             case ALLOC: /* malloc */
                 index = trace->ops[i].index;
-                size = trace->ops[i].size;
+                size = OP_SIZE(trace, &trace->ops[i]);
                 if ((p = malloc(size)) == NULL)
                     unix_error("malloc failed in eval_libc_speed");
-                trace->blocks[index] = p;
+                trace->blocks[index].ptr = p;
                 break;
 
             case REALLOC: /* realloc */
                 index = trace->ops[i].index;
-                newsize = trace->ops[i].size;
-                oldp = trace->blocks[index];
+                newsize = OP_SIZE(trace, &trace->ops[i]);
+                oldp = trace->blocks[index].ptr;
                 if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
                     unix_error("realloc failed in eval_libc_speed\n");
 
-                trace->blocks[index] = newp;
+                trace->blocks[index].ptr = newp;
                 break;
 
             case FREE: /* free */
                 index = trace->ops[i].index;
                 if (index >= 0) {
-                    block = trace->blocks[index];
+                    block = trace->blocks[index].ptr;
                     free(block);
                 } else {
                     free(0);
@@ -1421,13 +2763,413 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * printlatency - prints the latency percentiles of each request type,
+ *                for the traces that were timed with -L.
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static const char *type_names[] = { "malloc", "free", "realloc" };
+    double ns = 1.0 / tsc_ghz();
+    int i, t;
+
+    printf("Latency by request type (ns):\n");
+    printf("%8s %9s%8s%8s%8s%8s  %s\n",
+           "request", "count", "p50", "p99", "p99.9", "max", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].latency[0] == NULL)
+            continue;
+        for (t = 0; t < 3; t++) {
+            hist_t *hist = stats[i].latency[t];
+            if (hist->count == 0)
+                continue;
+            printf("%8s %9llu%8.0f%8.0f%8.0f%8.0f  %s\n", type_names[t],
+                   (unsigned long long) hist->count,
+                   hist_percentile(hist, 50) * ns,
+                   hist_percentile(hist, 99) * ns,
+                   hist_percentile(hist, 99.9) * ns,
+                   hist->max * ns, stats[i].filename);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * printfrag - With -F, print the worst and mean of each fragmentation
+ *    metric, as percentages of the heap
+ */
+static void printfrag(int n, stats_t *stats)
+{
+    int i, m;
+
+    printf("Fragmentation (%% of heap, worst/mean):\n");
+    if (tab_mode)
+        printf("internal\t\tslack\t\texternal\t\tunusable\t\ttrace\n");
+    else
+        printf("%13s %13s %13s %13s  %s\n",
+               "internal", "slack", "external", "unusable", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].frag_samples == 0)
+            continue;
+        for (m = 0; m < FRAG_METRICS; m++)
+            printf(tab_mode ? "%.1f\t%.1f\t" : "%6.1f/%-6.1f ",
+                   stats[i].frag_max[m] * 100, stats[i].frag_mean[m] * 100);
+        printf("%s%s\n", tab_mode ? "" : " ", stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * The timings of one trace in a baseline file, one line per trace:
+ * the trace name, the number of runs and the Kops of each run.
+ */
+typedef struct {
+    char name[MAXLINE];
+    int runs;
+    double kops[BENCH_MAX_RUNS];
+} baseline_t;
+
+/* Read the baseline file baseline_in; returns the number of traces */
+static int read_baseline(baseline_t **baseline)
+{
+    FILE *f;
+    char line[MAXLINE * 2], format[32];
+    int n = 0, cap = 0;
+
+    /* the trace name must fit in name[] */
+    snprintf(format, sizeof(format), "%%%ds %%d%%n", MAXLINE - 1);
+    if ((f = fopen(baseline_in, "r")) == NULL)
+        unix_error("cannot open baseline %s", baseline_in);
+    *baseline = NULL;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        baseline_t *b;
+        char *p = line;
+        int len, r;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 16;
+            if ((*baseline = realloc(*baseline, cap * sizeof(baseline_t))) == NULL)
+                unix_error("realloc in read_baseline failed");
+        }
+        b = &(*baseline)[n];
+        if (sscanf(p, format, b->name, &b->runs, &len) != 2 ||
+            b->runs < 1 || b->runs > BENCH_MAX_RUNS)
+            app_error("%s: bad baseline line: %s", baseline_in, line);
+        for (r = 0; r < b->runs; r++) {
+            p += len;
+            if (sscanf(p, "%lf%n", &b->kops[r], &len) != 1)
+                app_error("%s: bad baseline line: %s", baseline_in, line);
+        }
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+/*
+ * save_baseline - With -W, write the timings of the traces that were
+ *    benchmarked to baseline_out
+ */
+static void save_baseline(int n, stats_t *stats)
+{
+    FILE *f;
+    int i, r;
+
+    if ((f = fopen(baseline_out, "w")) == NULL)
+        unix_error("cannot create baseline %s", baseline_out);
+    fprintf(f, "# mdriver -B baseline: trace, runs, Kops of each run\n");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].bench_runs == 0)
+            continue;
+        fprintf(f, "%s %d", base_name(stats[i].filename), stats[i].bench_runs);
+        for (r = 0; r < stats[i].bench_runs; r++)
+            fprintf(f, " %.6g", stats[i].bench_kops[r]);
+        fprintf(f, "\n");
+    }
+    if (fclose(f) != 0)
+        unix_error("cannot write baseline %s", baseline_out);
+}
+
+/*
+ * printbench - With -B, print the mean and median throughput of each
+ *    trace and a bootstrap confidence interval for the mean.  With -C,
+ *    also compare the medians with the baseline, with a bootstrap
+ *    interval for their ratio, and flag the traces that are slower by
+ *    at least BENCH_MIN_CHANGE with the whole interval below 1.
+ *    Returns the number of regressions.
+ */
+static int printbench(int n, stats_t *stats)
+{
+    baseline_t *baseline = NULL;
+    int num_baseline = 0, regressions = 0;
+    int i, j;
+
+    if (baseline_in != NULL)
+        num_baseline = read_baseline(&baseline);
+
+    printf("Benchmark of %d runs per trace (Kops, %.0f%% confidence):\n",
+           bench_runs, BENCH_CONFIDENCE * 100);
+    if (tab_mode)
+        printf("mean\tmedian\tci lo\tci hi\t%strace\n",
+               baseline ? "base\tchange %\tci lo\tci hi\tverdict\t" : "");
+    else
+        printf("%8s %8s %17s %s %s\n", "mean", "median", "interval of mean",
+               baseline ? "    base   change     interval of change " : "",
+               "trace");
+    for (i = 0; i < n; i++) {
+        const stats_t *st = &stats[i];
+        double lo, hi;
+
+        if (!st->valid || st->bench_runs == 0)
+            continue;
+        bench_ci_mean(st->bench_kops, st->bench_runs, BENCH_CONFIDENCE,
+                      BENCH_RESAMPLES, &lo, &hi);
+        printf(tab_mode ? "%.0f\t%.0f\t%.0f\t%.0f\t" : "%8.0f %8.0f  [%6.0f,%7.0f] ",
+               bench_mean(st->bench_kops, st->bench_runs),
+               bench_median(st->bench_kops, st->bench_runs), lo, hi);
+        if (baseline != NULL) {
+            const baseline_t *b = NULL;
+            for (j = 0; j < num_baseline && b == NULL; j++)
+                if (strcmp(baseline[j].name, base_name(st->filename)) == 0)
+                    b = &baseline[j];
+            if (b == NULL) {
+                printf(tab_mode ? "\t\t\t\t\t" : "%8s %8s %23s ", "--", "--", "");
+            } else {
+                double base = bench_median(b->kops, b->runs);
+                double ratio = bench_median(st->bench_kops, st->bench_runs) / base;
+                const char *verdict = "";
+                bench_ci_ratio(st->bench_kops, st->bench_runs, b->kops, b->runs,
+                               BENCH_CONFIDENCE, BENCH_RESAMPLES, &lo, &hi);
+                if (hi < 1 && ratio <= 1 - BENCH_MIN_CHANGE) {
+                    verdict = "REGRESSION";
+                    regressions++;
+                } else if (lo > 1 && ratio >= 1 + BENCH_MIN_CHANGE) {
+                    verdict = "faster";
+                }
+                printf(tab_mode ? "%.0f\t%+.1f\t%+.1f\t%+.1f\t%s\t" :
+                       "%8.0f %+7.1f%%  [%+6.1f%%,%+6.1f%%] %-10s ",
+                       base, (ratio - 1) * 100, (lo - 1) * 100, (hi - 1) * 100,
+                       verdict);
+            }
+        }
+        printf("%s%s\n", tab_mode ? "" : " ", st->filename);
+    }
+    if (baseline != NULL)
+        printf("%d regression%s against %s\n", regressions,
+               regressions == 1 ? "" : "s", baseline_in);
+    printf("\n");
+    free(baseline);
+    return regressions;
+}
+
+/*
+ * The following routines write the results as JSON (-J), for tools
+ * that track allocator performance across versions and machines.
+ */
+
+/* Write str as a JSON string */
+static void json_string(FILE *f, const char *str)
+{
+    const unsigned char *p;
+
+    fputc('"', f);
+    for (p = (const unsigned char *) str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(f, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(f, "\\u%04x", *p);
+        else
+            fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+/* Write "key": str */
+static void json_field(FILE *f, const char *key, const char *str)
+{
+    json_string(f, key);
+    fprintf(f, ": ");
+    json_string(f, str);
+}
+
+/* Write a number, or null for the nan or inf of an empty measurement */
+static void json_number(FILE *f, const char *key, const char *fmt, double x)
+{
+    fprintf(f, ", ");
+    json_string(f, key);
+    fprintf(f, ": ");
+    if (isfinite(x))
+        fprintf(f, fmt, x);
+    else
+        fprintf(f, "null");
+}
+
+/* Write the build and host details */
+static void json_host(FILE *f)
+{
+    static const char *page_names[] = { "regular", "thp", "hugetlb" };
+    char host[MAXLINE] = "", cpu_type[MAXLINE] = "", kernel[MAXLINE] = "";
+    struct utsname uts;
+
+    gethostname(host, sizeof(host) - 1);
+    read_cpu_type(cpu_type);
+    if (uname(&uts) == 0)
+        snprintf(kernel, sizeof(kernel), "%s %s %s", uts.sysname,
+                 uts.release, uts.machine);
+
+    fprintf(f, "  \"build\": {");
+    json_field(f, "id", BUILD_ID);
+    fprintf(f, ", ");
+    json_field(f, "compiler", __VERSION__);
+    fprintf(f, ", ");
+    json_field(f, "date", __DATE__ " " __TIME__);
+#ifdef THREAD_SAFE
+    fprintf(f, ", \"thread_safe\": true},\n");
+#else
+    fprintf(f, ", \"thread_safe\": false},\n");
+#endif
+
+    fprintf(f, "  \"host\": {");
+    json_field(f, "name", host);
+    fprintf(f, ", ");
+    json_field(f, "cpu", cpu_type);
+    fprintf(f, ", ");
+    json_field(f, "kernel", kernel);
+    fprintf(f, ", \"cpus\": %ld, \"tsc_ghz\": %.3f, \"page_size\": %zu, ",
+            sysconf(_SC_NPROCESSORS_ONLN), tsc_ghz(), mem_pagesize());
+    json_field(f, "heap_pages", page_names[mem_pages()]);
+    fprintf(f, ", ");
+    json_field(f, "copy", mem_copy_name(mem_copy()));
+    fprintf(f, "},\n");
+
+    fprintf(f, "  \"options\": {");
+    json_field(f, "allocator", mm->name);
+    fprintf(f, ", \"debug\": %d, \"maxfill\": %zu, \"stream\": %s, "
+            "\"procs\": %d, \"overlap_timing\": %s, \"bench_runs\": %d, "
+            "\"pin_cpu\": %d, \"warmup\": %g, \"discard_switches\": %s, "
+            "\"cold_cache\": %s},\n",
+            debug_mode, maxfill, stream_mode ? "true" : "false", num_procs,
+            overlap_timing ? "true" : "false", bench_runs, pin_cpu, warmup_secs,
+            discard_switches ? "true" : "false", cold_cache ? "true" : "false");
+}
+
+/* Write the results of one trace */
+static void json_trace(FILE *f, const stats_t *st)
+{
+    static const char *type_names[] = { "malloc", "free", "realloc" };
+    static const char *frag_names[] = {
+        "internal", "slack", "external", "unusable"
+    };
+    double ns = 1.0 / tsc_ghz();
+    const char *sep;
+    int e, t, m, r;
+
+    fprintf(f, "    {");
+    json_field(f, "trace", st->filename);
+    fprintf(f, ", \"weight\": %d, \"valid\": %s, \"ops\": %.0f", st->weight,
+            st->valid ? "true" : "false", st->ops);
+    if (!st->valid) {
+        fprintf(f, "}");
+        return;
+    }
+    json_number(f, "secs", "%.9g", st->secs);
+    json_number(f, "kops", "%.6g", st->ops * 1e-3 / st->secs);
+    json_number(f, "util", "%.6f", st->util);
+
+    sep = "";
+    for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+        if (st->events[e] < 0 || !(event_mask & (1u << e)))
+            continue;
+        fprintf(f, "%s", *sep ? sep : ",\n     \"events_per_op\": {");
+        json_string(f, fcyc_event_name(e));
+        fprintf(f, ": %.6g", st->events[e]);
+        sep = ", ";
+    }
+    if (*sep)
+        fprintf(f, "}");
+
+    if (st->latency[0] != NULL) {
+        fprintf(f, ",\n     \"latency_ns\": {");
+        for (t = 0; t < 3; t++) {
+            const hist_t *hist = st->latency[t];
+            fprintf(f, "%s\"%s\": {\"count\": %llu, \"p50\": %.1f, "
+                    "\"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}",
+                    t ? ", " : "", type_names[t],
+                    (unsigned long long) hist->count,
+                    hist_percentile(hist, 50) * ns,
+                    hist_percentile(hist, 99) * ns,
+                    hist_percentile(hist, 99.9) * ns, hist->max * ns);
+        }
+        fprintf(f, "}");
+    }
+
+    if (st->frag_samples > 0) {
+        fprintf(f, ",\n     \"fragmentation\": {\"samples\": %ld", st->frag_samples);
+        for (m = 0; m < FRAG_METRICS; m++)
+            fprintf(f, ", \"%s\": {\"worst\": %.6f, \"mean\": %.6f}",
+                    frag_names[m], st->frag_max[m], st->frag_mean[m]);
+        fprintf(f, "}");
+    }
+
+    if (st->bench_runs > 0) {
+        double lo, hi;
+        bench_ci_mean(st->bench_kops, st->bench_runs, BENCH_CONFIDENCE,
+                      BENCH_RESAMPLES, &lo, &hi);
+        fprintf(f, ",\n     \"bench\": {\"runs\": %d, \"mean_kops\": %.6g, "
+                "\"median_kops\": %.6g, \"ci_kops\": [%.6g, %.6g], "
+                "\"confidence\": %.2f, \"kops\": [", st->bench_runs,
+                bench_mean(st->bench_kops, st->bench_runs),
+                bench_median(st->bench_kops, st->bench_runs), lo, hi,
+                BENCH_CONFIDENCE);
+        for (r = 0; r < st->bench_runs; r++)
+            fprintf(f, "%s%.6g", r ? ", " : "", st->bench_kops[r]);
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}");
+}
+
+/*
+ * write_json - With -J, write the build and host details, the results
+ *    of each trace with every optional metric that was collected, and
+ *    the summary and score, to json_file.  With "-", the JSON goes to
+ *    stdout and the rest of the output to stderr.
+ */
+static void write_json(int n, stats_t *stats, double util, double kops,
+                       const double score[3])
+{
+    FILE *f = json_stdout != NULL ? json_stdout : fopen(json_file, "w");
+    int i;
+
+    if (f == NULL)
+        unix_error("cannot create %s", json_file);
+    fprintf(f, "{\n");
+    json_host(f);
+    fprintf(f, "  \"traces\": [\n");
+    for (i = 0; i < n; i++) {
+        json_trace(f, &stats[i]);
+        fprintf(f, "%s\n", i < n - 1 ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"summary\": {\"errors\": %d", errors);
+    json_number(f, "util", "%.6f", util);
+    json_number(f, "kops", "%.6g", kops);
+    fprintf(f, ", \"ref_kops\": %.6g, \"score\": {\"correctness\": %.1f, "
+            "\"checkpoint\": %.1f, \"final\": %.1f}}\n",
+            ref_throughput, score[0], score[1], score[2]);
+    fprintf(f, "}\n");
+    if (fclose(f) != 0)
+        unix_error("cannot write %s", json_file);
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and returns
  *                a summary of the stats to the caller. 
  */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 {
-    int i;
+    int i, e;
 
     /* weighted sums all */
     double sumsecs = 0;
@@ -1441,10 +3183,20 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\t%s",
+               latency_mode ? "p50 ns\tp99 ns\tp99.9 ns\tmax ns\t" : "");
+        for (e = 0; e < FCYC_NUM_EVENTS; e++)
+            if (event_mask & (1u << e))
+                printf("%s/op\t", fcyc_event_label(e));
+        printf("trace\n");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n",
-               "valid", "util", "ops", "msecs", "Kops", "trace");
+        printf("  %5s  %6s %7s%8s%8s %s",
+               "valid", "util", "ops", "msecs", "Kops",
+               latency_mode ? "  p50ns   p99ns p99.9ns   maxns " : "");
+        for (e = 0; e < FCYC_NUM_EVENTS; e++)
+            if (event_mask & (1u << e))
+                printf("%6s/op ", fcyc_event_label(e));
+        printf("%s\n", "trace");
     }
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
@@ -1507,6 +3259,46 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Latency percentiles over all request types */
+            if (latency_mode) {
+                if (stats[i].latency[0] != NULL) {
+                    hist_t all;
+                    double ns = 1.0 / tsc_ghz();
+                    int t;
+                    hist_reset(&all);
+                    for (t = 0; t < 3; t++)
+                        hist_merge(&all, stats[i].latency[t]);
+                    printf(tab_mode ? "%.0f\t%.0f\t%.0f\t%.0f\t" : "%7.0f %7.0f %7.0f %7.0f ",
+                           hist_percentile(&all, 50) * ns,
+                           hist_percentile(&all, 99) * ns,
+                           hist_percentile(&all, 99.9) * ns,
+                           all.max * ns);
+                } else if (tab_mode) {
+                    printf("\t\t\t\t");
+                } else {
+                    printf("%7s %7s %7s %7s ", "--", "--", "--", "--");
+                }
+            }
+
+            /* Hardware events per op */
+            for (e = 0; e < FCYC_NUM_EVENTS; e++) {
+                /* instructions and cycles are large, misses small */
+                int prec = e <= FCYC_CYCLES ? 1 : 3;
+                if (!(event_mask & (1u << e)))
+                    continue;
+                if (tab_mode) {
+                    if (stats[i].events[e] >= 0)
+                        printf("%.*f\t", prec, stats[i].events[e]);
+                    else
+                        printf("\t");
+                } else {
+                    if (stats[i].events[e] >= 0)
+                        printf("%9.*f ", prec, stats[i].events[e]);
+                    else
+                        printf("%9s ", "--");
+                }
+            }
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1674,19 +3466,16 @@ static int cparse(char *s, char **index) {
     return found;
 }
 
-/* Read throughput from file */
-static double lookup_ref_throughput() {
+/* Read the CPU model name from CPU_FILE into cpu_type, without spaces */
+static bool read_cpu_type(char *cpu_type) {
     char buf[MAXLINE];
     char *tokens[PLIMIT];
-    char cpu_type[MAXLINE] = "";
-    double tput = 0.0;
-    char *bench_type = BENCH_KEY;
 
     /* Scan file to find CPU type */
     FILE *ifile = fopen(CPU_FILE, "r");
     if (!ifile) {
         fprintf(stderr, "Warning: Could not find file '%s'\n", CPU_FILE);
-        return tput;
+        return false;
     }
     /* Read lines in file.  Parse each one to look for key */
     bool found = false;
@@ -1701,103 +3490,157 @@ static double lookup_ref_throughput() {
         }
     }
     fclose(ifile);
-    if (!found) {
+    if (!found)
         fprintf(stderr, "Warning: Could not find CPU type in file '%s'\n", CPU_FILE);
-        return tput;
-    }
-    /* Now try to find matching entry in throughput file */
-    FILE *tfile = fopen(THROUGHPUT_FILE, "r");
-    if (tfile == NULL) {
-        fprintf(stderr, "Warning: Could not open throughput file '%s'\n", THROUGHPUT_FILE);
-        return tput;
-    }
-    found = false;
-    while (fgets(buf, MAXLINE, tfile) != NULL) {
-        int t = cparse(buf, tokens);
-        if (t < 3)
-            continue;
-        if (strcmp(tokens[0], cpu_type) == 0 &&
-            strcmp(tokens[1], bench_type) == 0) {
-            tput = atof(tokens[2]);
-            found = true;
-            break;
-        }
-    }
-    fclose(tfile);
-    if (tput == 0.0) {
-        fprintf(stderr, "Warning: Could not find CPU '%s' benchmark '%s' in throughput file '%s'\n",
-                cpu_type, bench_type, THROUGHPUT_FILE);
+    return found;
+}
+
+/*
+ * host_fingerprint - Hash what the reference throughput depends on: the
+ *    machine, the build of mdriver (its version, compiler, optimization
+ *    and thread safety), the version of mm-ref.c, the trace directory,
+ *    and how the heap is set up.  Fills in the CPU type as a side
+ *    effect.
+ */
+static uint64_t host_fingerprint(char *cpu_type)
+{
+    char key[5 * MAXLINE], host[MAXLINE] = "";
+    struct utsname uts;
+    uint64_t hash = 0xcbf29ce484222325ull;  /* FNV-1a */
+    char *s;
+    /* mm-ref.c is compiled into mdriver, so a debug build times it slower */
+    static const char build[] = BUILD_ID
+#ifdef __OPTIMIZE__
+        " optimized"
+#endif
+#ifdef THREAD_SAFE
+        " thread-safe"
+#endif
+        ;
+
+    if (!read_cpu_type(cpu_type))
+        strcpy(cpu_type, "unknown");
+    gethostname(host, sizeof(host) - 1);
+    if (uname(&uts) != 0)
+        strcpy(uts.release, "");
+
+    /* the page backing is only known once a heap is set up */
+    mem_init();
+    mem_deinit();
+    snprintf(key, sizeof(key), "%d|%s|%ld|%s|%s|%s|%s|%s|%d|%s|%d", REF_VERSION,
+             cpu_type, sysconf(_SC_NPROCESSORS_ONLN), host, uts.release,
+             __VERSION__, build, ref_tracedir, mem_pages(),
+             mem_copy_name(mem_copy()), cold_cache);
+    for (s = key; *s != '\0'; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= 0x100000001b3ull;
     }
-    if (tput > 0.0 && verbose > 0) {
-        printf("Found benchmark throughput %.0f for cpu type %s, benchmark %s\n",
-               tput, cpu_type, bench_type);
+    return hash;
+}
+
+/* Find the throughput cached for a fingerprint; the last entry wins */
+static double lookup_ref_throughput(uint64_t fingerprint)
+{
+    char buf[MAXLINE];
+    unsigned long long hash;
+    double kops, tput = 0.0;
+    FILE *f = fopen(REF_CACHE_FILE, "r");
+
+    if (f == NULL)
+        return 0.0;
+    while (fgets(buf, MAXLINE, f) != NULL) {
+        if (sscanf(buf, "%llx %lf", &hash, &kops) == 2 &&
+            hash == fingerprint && kops > 0)
+            tput = kops;
     }
+    fclose(f);
     return tput;
 }
 
 /*
- * gen_file_name: Generate a file name that does not currently exist
- * Give template suitable for use with snprintf, with one entry suitable for an integer value.
- * E.g., "./file_%.8x.txt".
+ * time_ref_throughput - Check the reference allocator on the default
+ *    traces in the trace directory, time it the same way run_test times
+ *    mm.c, and return its average throughput over the traces that count
+ *    for performance, in Kops.
  */
-static char *gen_file_name(char *template, char *buf, int maxlen) {
-    
-    int r;
-    int lim = 100;
-    do {
-        r = random();
-        snprintf(buf, maxlen, template, r);
-        lim--;
-    } while (lim > 0 && access(buf, F_OK) == 0);
-    return lim > 0 ? buf : NULL;
+static double time_ref_throughput(void)
+{
+    const mm_plugin_t *saved = mm;
+    speed_t speed_params;
+    stats_t stats;
+    double secs = 0, ops = 0;
+    int i;
+
+    mm = &mm_ref;
+    for (i = 0; default_tracefiles[i] != NULL; i++) {
+        memset(&stats, 0, sizeof(stats));
+        mem_init();
+        trace_t *trace = read_trace(&stats, ref_tracedir, default_tracefiles[i]);
+        range_set_t *ranges = new_range_set(trace->num_ids);
+        /* a broken reference would set the targets from wrong answers */
+        if (!eval_mm_valid(trace, ranges))
+            app_error("The reference allocator failed on %s\n", trace->filename);
+        if (stats.weight == WALL || stats.weight == WPERF) {
+            speed_params.trace = trace;
+            speed_params.ranges = ranges;
+            timing_begin();
+            secs += fsec(eval_mm_speed, &speed_params);
+            timing_end();
+            ops += trace->num_ops;
+        }
+        free_trace(trace);
+        free_range_set(ranges);
+        mem_deinit();
+    }
+    mm = saved;
+    return secs > 0 ? ops / secs * 0.001 : 0.0;
 }
 
 /*
- * measure_ref_throughput: Measure throughput achieved by reference implementation
+ * measure_ref_throughput - Return the throughput of the reference
+ *    allocator on this host, from REF_CACHE_FILE if it has been measured
+ *    here before (and -R was not given), or else by timing it now.
  */
-static double measure_ref_throughput() {
-    double ltput = lookup_ref_throughput();
-    if (ltput > 0)
-        return ltput;
-    char buf[MAXLINE];
-    char cmd[MAXLINE];
-    char *fname = gen_file_name("./tput_%.8x.txt", buf, MAXLINE);
-    float t;
-    snprintf(cmd, MAXLINE, "%s > %s", REF_DRIVER,
-             fname);
-    if (verbose > 1) {
-        printf("Executing '%s'\n", cmd);
-    }
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Couldn't execute '%s'\n", cmd);
-        exit(1);
-    }
-    FILE *f = fopen(fname, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Couldn't open '%s'\n", fname);
-        exit(1);
-    }
-    if (fscanf(f, "%f", &t) != 1) {
-        fprintf(stderr, "Couldn't read result from '%s'\n", fname);
-        exit(1);
-    }
-    if (fclose(f) != 0) {
-        fprintf(stderr, "Couldn't close '%s'\n", fname);
+static double measure_ref_throughput()
+{
+    char cpu_type[MAXLINE];
+    uint64_t fingerprint = host_fingerprint(cpu_type);
+    double tput = remeasure_ref ? 0.0 : lookup_ref_throughput(fingerprint);
+    FILE *f;
+
+    if (tput > 0) {
+        if (verbose > 0)
+            printf("Found reference throughput %.0f for host %.16llx (%s)\n",
+                   tput, (unsigned long long) fingerprint, cpu_type);
+        return tput;
     }
-    snprintf(cmd, MAXLINE, "rm -f %s", fname);
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Couldn't delete '%s'\n", fname);
+
+    if (verbose > 0)
+        printf("Measuring reference throughput for host %.16llx (%s)\n",
+               (unsigned long long) fingerprint, cpu_type);
+    tput = time_ref_throughput();
+    if (tput <= 0)
+        app_error("Couldn't measure the reference throughput\n");
+    if (verbose > 0)
+        printf("Reference throughput %.0f\n", tput);
+
+    if ((f = fopen(REF_CACHE_FILE, "a")) == NULL) {
+        fprintf(stderr, "Warning: Could not write '%s'\n", REF_CACHE_FILE);
+        return tput;
     }
-    return (double) t;
+    fprintf(f, "%.16llx %.0f %s\n", (unsigned long long) fingerprint, tput,
+            cpu_type);
+    if (fclose(f) != 0)
+        fprintf(stderr, "Warning: Could not write '%s'\n", REF_CACHE_FILE);
+    return tput;
 }
 
-
 /*
  * usage - Explain the command line arguments
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVdDHEmMLSQFRxK] [-f <file>] [-j <n>] [-P <n>] [-p <list>] [-U <csv> [-N <n>]] [-A <so>]... [-X <so>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1810,4 +3653,31 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-H         Back the heap with huge pages\n");
+    fprintf(stderr, "\t-E         Copy heap data 8 bytes at a time through mem_read/mem_write\n");
+    fprintf(stderr, "\t-m         Report dTLB load misses per op (-p dtlb-misses)\n");
+    fprintf(stderr, "\t-p <list>  Report hardware events per op: comma-separated\n"
+                    "\t           instructions, cycles, l1d-misses, llc-misses,\n"
+                    "\t           dtlb-misses, branch-misses, or all\n");
+    fprintf(stderr, "\t-S         Stream traces from disk: no payload checks, one timed run\n");
+    fprintf(stderr, "\t-L         Report per-request latency percentiles (-V: by request type)\n");
+    fprintf(stderr, "\t-j <n>     Also replay each trace on n threads at once (mdriver-mt)\n");
+    fprintf(stderr, "\t-M         With -j, thread i replays the i-th trace after it\n");
+    fprintf(stderr, "\t-P <n>     Evaluate up to n traces at once in worker processes\n");
+    fprintf(stderr, "\t-Q         With -P, let the timing runs overlap (faster, less accurate)\n");
+    fprintf(stderr, "\t-F         Report internal and external fragmentation\n");
+    fprintf(stderr, "\t-B <n>     Benchmark: time each trace n times, report mean, median, CI\n");
+    fprintf(stderr, "\t-C <file>  With -B, compare with the baseline <file>, flag regressions\n");
+    fprintf(stderr, "\t-W <file>  With -B, save the timings as a baseline in <file>\n");
+    fprintf(stderr, "\t-J <file>  Also write the results and host details as JSON (-: stdout)\n");
+    fprintf(stderr, "\t-R         Time the reference allocator again, even if cached\n");
+    fprintf(stderr, "\t-b <cpu>   Pin the timing runs to CPU <cpu>\n");
+    fprintf(stderr, "\t-w <s>     Warm up for up to s secs, until the clock speed is steady\n");
+    fprintf(stderr, "\t-x         Discard timing samples with context switches\n");
+    fprintf(stderr, "\t-K         Time with cold caches, flushed before every replay\n");
+    fprintf(stderr, "\t-U <csv>   Write heap and free list usage over time to <csv>\n");
+    fprintf(stderr, "\t-N <n>     With -U, sample every n requests (default %d)\n",
+            TIMELINE_INTERVAL);
+    fprintf(stderr, "\t-A <so>    Also run the allocator plugin <so> and compare (repeatable)\n");
+    fprintf(stderr, "\t-X <so>    Also time the trace compiled into <so> by rep2c\n");
 }
@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,41 +15,695 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <limits.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#define MEM_HAVE_SIMD
+#endif
 
 #include "memlib.h"
 #include "config.h"
 
+/* A contiguous run of address space obtained from the page provider */
+typedef struct {
+    unsigned char *lo;          /* first byte of the segment */
+    size_t len;                 /* bytes reserved for the segment */
+} segment_t;
+
+/*
+ * Header page in front of a persistent heap.  The rest of the page is
+ * handed to the allocator by mem_root().
+ */
+typedef struct {
+    uint64_t magic;             /* MEM_HDR_MAGIC */
+    uint64_t base;              /* address the file must be mapped at */
+    uint64_t len;               /* bytes mapped, including this page */
+    uint64_t brk;               /* heap bytes handed out by mem_sbrk */
+} mem_hdr_t;
+
+#define MEM_HDR_MAGIC 0x6d656d6c69623031ULL /* "memlib01" */
+#define MEM_HDR_SIZE 64                     /* mem_hdr_t, padded */
+
 /* private global variables */
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static unsigned char *mem_commit_addr;      /* End of committed part of segment */
+static size_t mem_prev_size;                /* Heap bytes in earlier segments */
+static segment_t segments[MEM_MAX_SEGMENTS]; /* Segments in order of creation */
+static int num_segments;                    /* Number of segments in use */
+static mem_pages_t page_mode = MEM_PAGES_DEFAULT; /* Requested page backing */
+static mem_pages_t active_mode;             /* Page backing actually in use */
+static const char *backing_file = MEM_BACKING_FILE; /* Used by mem_provider_file */
+static mem_hdr_t *mem_hdr;                  /* Header of a persistent heap, or NULL */
+static uint64_t root_area[MEM_ROOT_SIZE / sizeof(uint64_t)]; /* mem_root() otherwise */
+#ifdef DRIVER
+static const mem_provider_t *provider = &mem_provider_sim;
+#else
+static const mem_provider_t *provider = &mem_provider_mmap;
+#endif
+
+/* Round x up to a multiple of the power of two a */
+static size_t round_up(size_t x, size_t a) {
+    return (x + a - 1) & ~(a - 1);
+}
+
+/*************** Page providers *******************/
+
+/*
+ * Simulated provider: a single MAX_HEAP_SIZE reservation made by
+ * mem_init.  It cannot grow, which keeps the driver's heap contiguous
+ * and deterministic.
+ */
+static unsigned char *sim_map_addr;         /* Start of the underlying mapping */
+static size_t sim_map_len;                  /* Length of the underlying mapping */
+static size_t hugetlb_page;                 /* Page size of a hugetlb heap */
+static size_t hugetlb_len;                  /* Bytes at its start from the hugetlb pool */
+
+/*
+ * hugetlb_pool_bytes - bytes of free pages in the hugetlb pool, read
+ *              from /proc/meminfo, and the size of those pages in *page.
+ *              Returns 0 if the pool is empty or cannot be read.
+ */
+static size_t hugetlb_pool_bytes(size_t *page) {
+    char buf[128];
+    long pages = -1, kb = 0;
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+	return 0;
+    while (fgets(buf, sizeof(buf), fp)) {
+	sscanf(buf, "HugePages_Free: %ld", &pages);
+	sscanf(buf, "Hugepagesize: %ld kB", &kb);
+    }
+    fclose(fp);
+    if (pages <= 0 || kb <= 0)
+	return 0;
+    *page = (size_t) kb * 1024;
+    return (size_t) pages * *page;
+}
+
+/*
+ * map_heap_thp - reserve the heap with an extra page of slack so that
+ *              its start can be aligned to a huge page of size align,
+ *              then ask for transparent huge pages on it.
+ */
+static unsigned char *map_heap_thp(size_t align) {
+    size_t len = MAX_HEAP_SIZE + align;
+    unsigned char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+    sim_map_addr = addr;
+    sim_map_len = len;
+    addr = (unsigned char *) round_up((size_t) addr, align);
+#ifdef MADV_HUGEPAGE
+    if (madvise(addr, MAX_HEAP_SIZE, MADV_HUGEPAGE) != 0)
+	fprintf(stderr, "Warning: madvise(MADV_HUGEPAGE) failed, heap uses regular pages\n");
+#endif
+    return addr;
+}
+
+/*
+ * map_heap_hugetlb - replace the start of the heap at addr with
+ *              MEM_HUGETLB_SIZE, rounded up to whole pages, from the
+ *              hugetlb pool, or the whole free pool if it is smaller.
+ *              That part is fully reserved, so we never take a SIGBUS
+ *              on a fault; the heap grows on past it in transparent
+ *              huge pages.  Returns the bytes mapped, 0 on failure.
+ */
+static size_t map_heap_hugetlb(unsigned char *addr, size_t page, size_t pool) {
+#ifdef MAP_HUGETLB
+    size_t want = round_up(MEM_HUGETLB_SIZE, page);
+    if (want > pool)
+	want = pool;
+    if (mmap(addr, want, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0) == MAP_FAILED)
+	return 0;
+    return want;
+#else
+    return 0;
+#endif
+}
+
+static void *sim_reserve(void *hint, size_t *len) {
+    unsigned char *addr;
+    size_t page = HUGE_PAGE_SIZE, pool = 0;
+
+    if (hint != NULL)
+	return NULL;
+    *len = MAX_HEAP_SIZE;
+    active_mode = MEM_PAGES_DEFAULT;
+    hugetlb_len = 0;
+    if (page_mode != MEM_PAGES_DEFAULT) {
+	if (page_mode == MEM_PAGES_HUGETLB)
+	    pool = hugetlb_pool_bytes(&page);
+	if ((addr = map_heap_thp(page > HUGE_PAGE_SIZE ? page : HUGE_PAGE_SIZE)) == NULL)
+	    return NULL;
+	active_mode = MEM_PAGES_THP;
+	/* Without a hugetlb pool, stay on transparent huge pages */
+	if (pool > 0 && (hugetlb_len = map_heap_hugetlb(addr, page, pool)) > 0) {
+	    hugetlb_page = page;
+	    active_mode = MEM_PAGES_HUGETLB;
+	}
+	return addr;
+    }
+    addr = mmap(NULL,                                        /* start*/
+                MAX_HEAP_SIZE,                               /* length */
+                PROT_READ | PROT_WRITE,                      /* permissions */
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
+                -1,                                          /* fd */
+                0);                                          /* offset */
+    if (addr == MAP_FAILED)
+	return NULL;
+    sim_map_addr = addr;
+    sim_map_len = MAX_HEAP_SIZE;
+    return addr;
+}
+
+static bool sim_commit(void *addr, size_t len) {
+    return true;
+}
+
+static bool sim_decommit(void *addr, size_t len) {
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
+static bool sim_release(void *addr, size_t len) {
+    return munmap(sim_map_addr, sim_map_len) == 0;
+}
+
+const mem_provider_t mem_provider_sim = {
+    "simulated", sim_reserve, sim_commit, sim_decommit, sim_release
+};
+
+/*
+ * sbrk provider: the real program break.  Reservations stay
+ * contiguous as long as nobody else in the process moves the break.
+ */
+static void *sbrk_reserve(void *hint, size_t *len) {
+    void *addr = sbrk((intptr_t) *len);
+    return addr == (void *) -1 ? NULL : addr;
+}
+
+static bool sbrk_commit(void *addr, size_t len) {
+    return true;
+}
+
+static bool sbrk_decommit(void *addr, size_t len) {
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
+static bool sbrk_release(void *addr, size_t len) {
+    /* Only the topmost reservation can be handed back */
+    if ((unsigned char *) addr + len != sbrk(0))
+	return false;
+    return sbrk(-(intptr_t) len) != (void *) -1;
+}
+
+const mem_provider_t mem_provider_sbrk = {
+    "sbrk", sbrk_reserve, sbrk_commit, sbrk_decommit, sbrk_release
+};
+
+/*
+ * mmap provider: anonymous MEM_RESERVE_CHUNK sized reservations,
+ * mapped PROT_NONE and made accessible as the break passes over them.
+ * A new chunk lands right after the previous one when that address is
+ * free; otherwise it starts a new segment.
+ */
+static void *mmap_reserve(void *hint, size_t *len) {
+    void *addr = mmap(hint, *len, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+#ifdef MADV_HUGEPAGE
+    if (page_mode != MEM_PAGES_DEFAULT)
+	madvise(addr, *len, MADV_HUGEPAGE);
+#endif
+    return addr;
+}
+
+static bool mmap_commit(void *addr, size_t len) {
+    return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+static bool mmap_decommit(void *addr, size_t len) {
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
+static bool mmap_release(void *addr, size_t len) {
+    return munmap(addr, len) == 0;
+}
+
+const mem_provider_t mem_provider_mmap = {
+    "mmap", mmap_reserve, mmap_commit, mmap_decommit, mmap_release
+};
+
+/*
+ * file provider: private mappings of successive ranges of the file set
+ * with mem_set_backing_file.  The heap never writes to the file, which
+ * only grows with ftruncate as reservations are made, so a forked child
+ * gets its own copy of the heap.  A process locks the file it maps;
+ * one that finds it locked by another (an exec'd child, say) uses an
+ * unlinked <file>.<pid> instead, so nobody truncates a mapped file.
+ */
+static int file_fd = -1;                    /* Backing file descriptor */
+static off_t file_end;                      /* Bytes of the file reserved so far */
+
+/* Open and lock an empty backing file; returns -1 on failure */
+static int open_backing_file(void) {
+    char path[PATH_MAX];
+    int fd = open(backing_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+	/* Mapped by another process: use a file of our own */
+	close(fd);
+	snprintf(path, sizeof(path), "%s.%d", backing_file, (int) getpid());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0)
+	    unlink(path);
+	return fd;
+    }
+    if (fd >= 0 && ftruncate(fd, 0) != 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static void *file_reserve(void *hint, size_t *len) {
+    if (file_fd < 0) {
+	/* First reservation, or the first one since a fork() */
+	if ((file_fd = open_backing_file()) < 0)
+	    return NULL;
+	file_end = 0;
+    } else if (hint == NULL) {
+	/* A new heap: the file is still zero, just map it from the start */
+	file_end = 0;
+    }
+    /* Only grow the file: a forked child may still map the far end */
+    struct stat st;
+    if (fstat(file_fd, &st) != 0)
+	return NULL;
+    if (st.st_size < file_end + (off_t) *len &&
+        ftruncate(file_fd, file_end + *len) != 0)
+	return NULL;
+    void *addr = mmap(hint, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      file_fd, file_end);
+    if (addr == MAP_FAILED)
+	return NULL;
+    file_end += *len;
+    return addr;
+}
+
+static bool file_commit(void *addr, size_t len) {
+    return true;
+}
+
+static bool file_decommit(void *addr, size_t len) {
+    /* Drop our private copy; the range reads as the (zero) file again */
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
+static bool file_release(void *addr, size_t len) {
+    return munmap(addr, len) == 0;
+}
+
+const mem_provider_t mem_provider_file = {
+    "file", file_reserve, file_commit, file_decommit, file_release
+};
+
+/*
+ * persist provider: a heap file mapped whole, with a header page in
+ * front of the heap.  Persistent heaps are mapped at MEM_PERSIST_BASE
+ * so that the pointers inside them stay valid; shared heaps can be at
+ * a different address in every process that maps them.  The mapping
+ * is made whole up front, so the heap can't grow past its file.
+ */
+static int heap_fd = -1;                    /* Persistent or shared heap file */
+static unsigned char *heap_fixed_base;      /* Address it must be mapped at, or NULL */
+static size_t heap_file_len;                /* Bytes of the file that are mapped */
+static bool heap_detached;                  /* A forked child's copy of a persistent heap */
+
+static void *persist_reserve(void *hint, size_t *len) {
+    struct stat st;
+    unsigned char *base = heap_fixed_base;
+    size_t page = mem_pagesize();
+    int flags = MAP_SHARED;
+
+    if (hint != NULL || heap_fd < 0)
+	return NULL;
+    if (fstat(heap_fd, &st) != 0)
+	return NULL;
+    if (st.st_size == 0 && ftruncate(heap_fd, heap_file_len) != 0)
+	return NULL;
+    if (st.st_size != 0 && (size_t) st.st_size != heap_file_len) {
+	fprintf(stderr, "ERROR: %s is not a heap of %zu bytes\n", backing_file,
+		heap_file_len);
+	return NULL;
+    }
+    /* Pointers inside a persistent heap are only valid at the same address */
+    if (base != NULL)
+	flags |= MAP_FIXED_NOREPLACE;
+    unsigned char *addr = mmap(base, heap_file_len, PROT_READ | PROT_WRITE,
+                               flags, heap_fd, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+    if (base != NULL && addr != base) {
+	/* Kernels without MAP_FIXED_NOREPLACE treat it as a hint */
+	munmap(addr, heap_file_len);
+	return NULL;
+    }
+    mem_hdr = (mem_hdr_t *) addr;
+    if (mem_hdr->magic != MEM_HDR_MAGIC) {
+	mem_hdr->base = (uint64_t) base;
+	mem_hdr->len = heap_file_len;
+	mem_hdr->brk = 0;
+	mem_hdr->magic = MEM_HDR_MAGIC;
+    } else if (mem_hdr->base != (uint64_t) base || mem_hdr->len != heap_file_len) {
+	fprintf(stderr, "ERROR: %s was created with a different layout\n", backing_file);
+	munmap(addr, heap_file_len);
+	mem_hdr = NULL;
+	return NULL;
+    }
+    *len = heap_file_len - page;
+    return addr + page;
+}
+
+static bool persist_commit(void *addr, size_t len) {
+    return true;
+}
+
+static bool persist_decommit(void *addr, size_t len) {
+    return madvise(addr, len, MADV_REMOVE) == 0;
+}
+
+static bool persist_release(void *addr, size_t len) {
+    bool ok = munmap((unsigned char *) addr - mem_pagesize(), heap_file_len) == 0;
+    close(heap_fd);
+    heap_fd = -1;
+    mem_hdr = NULL;
+    return ok;
+}
+
+static const mem_provider_t mem_provider_persist = {
+    "persist", persist_reserve, persist_commit, persist_decommit, persist_release
+};
+
+/*
+ * Around fork(): a persistent heap's lock is not process-shared, so a
+ * child must not allocate from its parent's heap.  mem_fork_prepare
+ * copies the heap while the allocator is locked, and the child puts
+ * the copy in its place at the same address.  The copy is not
+ * persistent.  A shared heap stays shared: that is its use.
+ */
+static unsigned char *fork_copy;            /* Copy of a persistent heap for the child */
+
+static bool heap_is_persistent(void) {
+    return mem_hdr != NULL && heap_fixed_base != NULL && !heap_detached;
+}
+
+/* Called by the allocator before fork(), with its lock held */
+void mem_fork_prepare(void) {
+    size_t page = mem_pagesize();
+    void *copy;
+
+    if (!heap_is_persistent())
+	return;
+    copy = mmap(NULL, heap_file_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (copy == MAP_FAILED)
+	return;
+    memcpy(copy, mem_hdr, page + round_up(mem_hdr->brk, page));
+    fork_copy = copy;
+}
+
+/* Called by the allocator in the parent after fork() */
+void mem_fork_parent(void) {
+    if (fork_copy != NULL)
+	munmap(fork_copy, heap_file_len);
+    fork_copy = NULL;
+}
+
+/*
+ * mem_fork_child - called by the allocator in the child after fork().
+ *              With the file provider the child stops growing its
+ *              parent's heap file.  It keeps the descriptor open, and
+ *              with it the lock, as its copy of the heap is still
+ *              backed by the file; its next reservation opens a file of
+ *              its own.  A persistent heap is replaced by its copy.
+ */
+void mem_fork_child(void) {
+    file_fd = -1;
+    if (!heap_is_persistent())
+	return;
+    if (fork_copy == NULL ||
+        mremap(fork_copy, heap_file_len, heap_file_len,
+               MREMAP_MAYMOVE | MREMAP_FIXED, mem_hdr) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: cannot copy the persistent heap into a child\n");
+	abort();
+    }
+    fork_copy = NULL;
+    close(heap_fd);
+    heap_fd = -1;
+    heap_detached = true;
+}
+
+/*
+ * mem_set_provider - choose the page provider used by subsequent
+ *              calls to mem_init
+ */
+void mem_set_provider(const mem_provider_t *p) {
+    provider = p;
+}
+
+/*
+ * mem_set_backing_file - set the file used by mem_provider_file
+ */
+void mem_set_backing_file(const char *path) {
+    backing_file = path;
+}
+
+/*************** Heap management *******************/
+
+/*
+ * new_segment - reserve at least len bytes, preferably right after
+ *              the current segment.  Returns false if the provider is
+ *              out of address space.
+ */
+static bool new_segment(size_t len) {
+    unsigned char *hint = num_segments > 0 ? mem_max_addr : NULL;
+    unsigned char *addr = provider->reserve(hint, &len);
+
+    if (addr == NULL)
+	return false;
+    if (addr == hint) {
+	/* Grew the current segment in place */
+	segments[num_segments-1].len += len;
+	mem_max_addr += len;
+	return true;
+    }
+    if (num_segments == MEM_MAX_SEGMENTS) {
+	provider->release(addr, len);
+	return false;
+    }
+    if (num_segments > 0)
+	mem_prev_size += (size_t)(mem_brk - segments[num_segments-1].lo);
+    segments[num_segments].lo = addr;
+    segments[num_segments].len = len;
+    num_segments++;
+    mem_brk = addr;
+    mem_commit_addr = addr;
+    mem_max_addr = addr + len;
+    return true;
+}
+
+/*
+ * open_heap_file - map the heap in heap_fd through the persist
+ *              provider and restore its break from the header page.
+ */
+static int open_heap_file(void) {
+    size_t len = heap_file_len;
+    int existed;
+
+    provider = &mem_provider_persist;
+    num_segments = 0;
+    mem_prev_size = 0;
+    active_mode = MEM_PAGES_DEFAULT;
+    if (!new_segment(len)) {
+	fprintf(stderr, "FAILURE.  couldn't map heap %s\n", backing_file);
+	if (heap_fd >= 0)
+	    close(heap_fd);
+	heap_fd = -1;
+	return -1;
+    }
+    existed = mem_hdr->brk != 0;
+    heap = segments[0].lo;
+    mem_brk = heap + mem_hdr->brk;
+    mem_commit_addr = mem_max_addr;
+    return existed;
+}
+
+/*
+ * mem_open_persistent - map the persistent heap in file path (or
+ *              MEM_PERSIST_FILE if NULL) at MEM_PERSIST_BASE, creating
+ *              it if needed.  Unlike mem_init, the break is restored
+ *              from the file.  Returns 1 if an existing heap was
+ *              reopened, 0 if a new one was created and -1 on failure,
+ *              with errno EBUSY if another process has the heap open.
+ */
+int mem_open_persistent(const char *path) {
+    heap_detached = false;
+    backing_file = path != NULL ? path : MEM_PERSIST_FILE;
+    heap_fd = open(backing_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    /* One live process owns the heap: its lock is not process-shared */
+    if (heap_fd >= 0 && flock(heap_fd, LOCK_EX | LOCK_NB) != 0) {
+	close(heap_fd);
+	heap_fd = -1;
+	errno = EBUSY;
+	return -1;
+    }
+    heap_fixed_base = (unsigned char *) MEM_PERSIST_BASE;
+    heap_file_len = MEM_PERSIST_SIZE;
+    return open_heap_file();
+}
+
+/*
+ * mem_shared_fd - create (or open) a file for a shared heap: an
+ *              anonymous memfd if name is NULL, else the POSIX shared
+ *              memory object name.  Returns -1 on failure.
+ */
+int mem_shared_fd(const char *name) {
+    if (name == NULL)
+	return memfd_create("mm-heap", 0);
+    return shm_open(name, O_RDWR | O_CREAT, 0600);
+}
+
+/*
+ * mem_open_shared - map the shared heap in fd, which may be mapped at
+ *              a different address by every process using it.  Returns
+ *              like mem_open_persistent.
+ */
+int mem_open_shared(int fd) {
+    heap_detached = false;
+    backing_file = "shared heap";
+    heap_fd = dup(fd);
+    heap_fixed_base = NULL;
+    heap_file_len = MEM_SHARED_SIZE;
+    return open_heap_file();
+}
+
+/*
+ * mem_offset, mem_at - convert between heap addresses and offsets from
+ *              the start of the heap, which are the same in every
+ *              process that maps a shared heap.
+ */
+size_t mem_offset(const void *p) {
+    return (size_t)((const unsigned char *) p - heap);
+}
+
+void *mem_at(size_t off) {
+    return heap + off;
+}
+
+/*
+ * sync_brk - another process may have moved the break of a shared heap
+ */
+static inline void sync_brk(void) {
+    if (mem_hdr != NULL)
+	mem_brk = heap + mem_hdr->brk;
+}
+
+/*
+ * mem_sync - write a persistent heap and its header page back to the
+ *              file.  A no-op for other heaps.  Fails in a forked
+ *              child, whose copy of the heap is not persistent.
+ */
+bool mem_sync(void) {
+    size_t page = mem_pagesize();
+    if (mem_hdr == NULL)
+	return true;
+    if (heap_detached)
+	return false;
+    return msync(mem_hdr, page + round_up(mem_hdr->brk, page), MS_SYNC) == 0;
+}
+
+/*
+ * mem_root - return MEM_ROOT_SIZE bytes that the allocator can use for
+ *              its own roots.  For a persistent heap they are in the
+ *              header page and survive a restart.
+ */
+void *mem_root(void) {
+    if (mem_hdr != NULL)
+	return (unsigned char *) mem_hdr + MEM_HDR_SIZE;
+    return root_area;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(){
-    unsigned char* addr = mmap(NULL,                                        /* start*/
-                               MAX_HEAP_SIZE,                               /* length */
-                               PROT_READ | PROT_WRITE,                      /* permissions */
-                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
-                               -1,                                          /* fd */
-                               0);                                          /* offset */
-    if (addr == MAP_FAILED) {
-	fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
+    size_t len = MEM_RESERVE_CHUNK;
+    num_segments = 0;
+    mem_prev_size = 0;
+    active_mode = MEM_PAGES_DEFAULT;
+    if (!new_segment(len)) {
+	fprintf(stderr, "FAILURE.  %s provider couldn't allocate space for heap\n",
+		provider->name);
 	exit(1);
     }
-    heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
+    heap = segments[0].lo;
     mem_reset_brk();
 }
 
+/*
+ * mem_set_pages - choose the page backing used by subsequent calls to
+ *              mem_init.  MEM_PAGES_HUGETLB falls back to MEM_PAGES_THP
+ *              when the hugetlb pool is empty.
+ */
+void mem_set_pages(mem_pages_t mode) {
+    page_mode = mode;
+}
+
+/*
+ * mem_pages - return the page backing of the current heap
+ */
+mem_pages_t mem_pages(void) {
+    return active_mode;
+}
+
+/*
+ * mem_hugetlb_size - return the bytes at the start of the current (or
+ *              last) heap that come from the hugetlb pool
+ */
+size_t mem_hugetlb_size(void) {
+    return hugetlb_len;
+}
+
+/*
+ * trim_granule - decommit whole pages of the heap's backing: splitting
+ *              a huge page would cost more than the memory it frees,
+ *              and hugetlb pages can't be split at all
+ */
+static size_t trim_granule(void) {
+    if (active_mode == MEM_PAGES_HUGETLB && hugetlb_page > HUGE_PAGE_SIZE)
+	return hugetlb_page;
+    if (page_mode != MEM_PAGES_DEFAULT)
+	return HUGE_PAGE_SIZE;
+    return mem_pagesize();
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-    if (munmap(heap, MAX_HEAP_SIZE) != 0) {
-        fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
-        exit(1);
+    while (num_segments > 0) {
+	segment_t *s = &segments[--num_segments];
+	if (!provider->release(s->lo, s->len) && provider != &mem_provider_sbrk) {
+	    fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
+	    exit(1);
+	}
     }
 }
 
@@ -56,15 +711,29 @@ void mem_deinit(void){
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk(){
+    /* Only the first segment survives a reset */
+    while (num_segments > 1) {
+	segment_t *s = &segments[--num_segments];
+	provider->release(s->lo, s->len);
+    }
     mem_brk = heap;
+    if (mem_hdr != NULL)
+	mem_hdr->brk = 0;
+    mem_max_addr = heap + segments[0].len;
+    mem_prev_size = 0;
+    if (mem_commit_addr < heap || mem_commit_addr > mem_max_addr)
+	mem_commit_addr = heap;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		this model, the heap cannot be shrunk.  If the provider
+ *		can't extend the current segment, the area is carved from a
+ *		new segment that is not contiguous with the old break.
  */
 void *mem_sbrk(intptr_t incr) {
+    sync_brk();
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
@@ -72,12 +741,31 @@ void *mem_sbrk(intptr_t incr) {
 	ok = false;
 	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
     } else if (mem_brk + incr > mem_max_addr) {
-	ok = false;
-	long alloc = mem_brk - heap + incr;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+	/* Leave room for the caller to grow the new segment a little */
+	size_t len = round_up(incr, mem_pagesize()) + MEM_RESERVE_CHUNK;
+	if (!new_segment(len)) {
+	    ok = false;
+	    long alloc = mem_heapsize() + incr;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+	} else {
+	    old_brk = mem_brk;
+	}
+    }
+    if (ok && mem_brk + incr > mem_commit_addr) {
+	unsigned char *end = (unsigned char *) round_up((size_t)(mem_brk + incr), mem_pagesize());
+	if (end > mem_max_addr)
+	    end = mem_max_addr;
+	if (!provider->commit(mem_commit_addr, end - mem_commit_addr)) {
+	    ok = false;
+	    fprintf(stderr, "ERROR: mem_sbrk failed.  %s provider couldn't commit memory\n", provider->name);
+	} else {
+	    mem_commit_addr = end;
+	}
     }
     if (ok) {
 	mem_brk += incr;
+	if (mem_hdr != NULL)
+	    mem_hdr->brk = (uint64_t)(mem_brk - heap);
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -85,6 +773,21 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mem_decommit - return the pages wholly inside [addr, addr+len) to
+ *              the provider, huge pages with -H.  The range stays part
+ *              of the heap and reads back as zeros once it is touched
+ *              again.
+ */
+bool mem_decommit(void *addr, size_t len) {
+    size_t page = trim_granule();
+    unsigned char *lo = (unsigned char *) round_up((size_t) addr, page);
+    unsigned char *hi = (unsigned char *)(((size_t) addr + len) & ~(page - 1));
+    if (hi <= lo)
+	return true;
+    return provider->decommit(lo, hi - lo);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -93,17 +796,19 @@ void *mem_heap_lo(){
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte in the current segment
  */
 void *mem_heap_hi(){
+    sync_brk();
     return (void *)(mem_brk - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, over all segments
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    sync_brk();
+    return mem_prev_size + (size_t)(mem_brk - segments[num_segments-1].lo);
 }
 
 /*
@@ -136,8 +841,42 @@ void mem_write(void *addr, uint64_t val, size_t len) {
         memcpy(addr, (void *) &val, len);
 }
 
+static mem_copy_t copy_mode = MEM_COPY_AUTO; /* Resolved on first use */
+
+/*
+ * mem_set_copy - choose how mem_memcpy and mem_memset move data.
+ *              MEM_COPY_EMULATED keeps every access going through
+ *              mem_read and mem_write, for debugging.
+ */
+void mem_set_copy(mem_copy_t mode) {
+    copy_mode = mode;
+#ifdef MEM_HAVE_SIMD
+    __builtin_cpu_init();
+    if (copy_mode == MEM_COPY_AVX2 && !__builtin_cpu_supports("avx2"))
+	copy_mode = MEM_COPY_AUTO;
+    if (copy_mode == MEM_COPY_AUTO)
+	copy_mode = __builtin_cpu_supports("avx2") ? MEM_COPY_AVX2 : MEM_COPY_SSE2;
+#else
+    copy_mode = MEM_COPY_EMULATED;
+#endif
+}
+
+/*
+ * mem_copy - return how data is moved
+ */
+mem_copy_t mem_copy(void) {
+    if (copy_mode == MEM_COPY_AUTO)
+	mem_set_copy(MEM_COPY_AUTO);
+    return copy_mode;
+}
+
+const char *mem_copy_name(mem_copy_t mode) {
+    static const char *names[] = { "auto", "emulated", "sse2", "avx2" };
+    return names[mode];
+}
+
 /* Emulation of memcpy */
-void *mem_memcpy(void *dst, const void *src, size_t n) {
+static void *copy_emulated(void *dst, const void *src, size_t n) {
     void *savedst = dst;
     size_t w = sizeof(uint64_t);
     while (n >= w) {
@@ -155,7 +894,7 @@ void *mem_memcpy(void *dst, const void *src, size_t n) {
 }
 
 /* Emulation of memset */
-void *mem_memset(void *dst, int c, size_t n) {
+static void *set_emulated(void *dst, int c, size_t n) {
     void *savedst = dst;
     uint64_t byte = c & 0xFF;
     uint64_t data = 0;
@@ -175,6 +914,190 @@ void *mem_memset(void *dst, int c, size_t n) {
     return savedst;
 }
 
+#ifdef MEM_HAVE_SIMD
+/*
+ * The vector versions move the bulk in whole vectors and finish with
+ * one vector ending at the last byte, overlapping what was already
+ * done, so there is no byte loop.  From MEM_NT_THRESHOLD bytes on, the
+ * destination is aligned and the bulk written with streaming stores.
+ */
+
+/* Copy fewer than 16 bytes */
+static void copy_small(unsigned char *d, const unsigned char *s, size_t n) {
+    uint64_t a, b;
+    uint32_t x, y;
+    if (n >= 8) {
+	memcpy(&a, s, 8);
+	memcpy(&b, s + n - 8, 8);
+	memcpy(d, &a, 8);
+	memcpy(d + n - 8, &b, 8);
+    } else if (n >= 4) {
+	memcpy(&x, s, 4);
+	memcpy(&y, s + n - 4, 4);
+	memcpy(d, &x, 4);
+	memcpy(d + n - 4, &y, 4);
+    } else {
+	while (n--)
+	    *d++ = *s++;
+    }
+}
+
+/* Set fewer than 16 bytes to the byte repeated in v */
+static void set_small(unsigned char *d, uint64_t v, size_t n) {
+    if (n >= 8) {
+	memcpy(d, &v, 8);
+	memcpy(d + n - 8, &v, 8);
+    } else if (n >= 4) {
+	memcpy(d, &v, 4);
+	memcpy(d + n - 4, &v, 4);
+    } else {
+	while (n--)
+	    *d++ = (unsigned char) v;
+    }
+}
+
+static void *copy_sse2(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    unsigned char *dend = d + n;
+    const unsigned char *send = s + n;
+
+    if (n < 16) {
+	copy_small(d, s, n);
+	return dst;
+    }
+    __m128i last = _mm_loadu_si128((const __m128i *) (send - 16));
+    if (n >= MEM_NT_THRESHOLD) {
+	size_t skip = 16 - ((uintptr_t) d & 15);
+	_mm_storeu_si128((__m128i *) d, _mm_loadu_si128((const __m128i *) s));
+	d += skip;
+	s += skip;
+	for (; d + 16 <= dend; d += 16, s += 16)
+	    _mm_stream_si128((__m128i *) d,
+			     _mm_loadu_si128((const __m128i *) s));
+	_mm_sfence();
+    } else {
+	for (; d + 16 <= dend; d += 16, s += 16)
+	    _mm_storeu_si128((__m128i *) d,
+			     _mm_loadu_si128((const __m128i *) s));
+    }
+    _mm_storeu_si128((__m128i *) (dend - 16), last);
+    return dst;
+}
+
+static void *set_sse2(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    unsigned char *dend = d + n;
+    __m128i v = _mm_set1_epi8((char) c);
+
+    if (n < 16) {
+	set_small(d, 0x0101010101010101ull * (unsigned char) c, n);
+	return dst;
+    }
+    _mm_storeu_si128((__m128i *) d, v);
+    if (n >= MEM_NT_THRESHOLD) {
+	d += 16 - ((uintptr_t) d & 15);
+	for (; d + 16 <= dend; d += 16)
+	    _mm_stream_si128((__m128i *) d, v);
+	_mm_sfence();
+    } else {
+	for (; d + 16 <= dend; d += 16)
+	    _mm_storeu_si128((__m128i *) d, v);
+    }
+    _mm_storeu_si128((__m128i *) (dend - 16), v);
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *copy_avx2(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    unsigned char *dend = d + n;
+    const unsigned char *send = s + n;
+
+    if (n < 32)
+	return copy_sse2(dst, src, n);
+    __m256i last = _mm256_loadu_si256((const __m256i *) (send - 32));
+    if (n >= MEM_NT_THRESHOLD) {
+	size_t skip = 32 - ((uintptr_t) d & 31);
+	_mm256_storeu_si256((__m256i *) d,
+			    _mm256_loadu_si256((const __m256i *) s));
+	d += skip;
+	s += skip;
+	for (; d + 128 <= dend; d += 128, s += 128) {
+	    __m256i a = _mm256_loadu_si256((const __m256i *) s);
+	    __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+	    __m256i e = _mm256_loadu_si256((const __m256i *) (s + 64));
+	    __m256i f = _mm256_loadu_si256((const __m256i *) (s + 96));
+	    _mm256_stream_si256((__m256i *) d, a);
+	    _mm256_stream_si256((__m256i *) (d + 32), b);
+	    _mm256_stream_si256((__m256i *) (d + 64), e);
+	    _mm256_stream_si256((__m256i *) (d + 96), f);
+	}
+	for (; d + 32 <= dend; d += 32, s += 32)
+	    _mm256_stream_si256((__m256i *) d,
+				_mm256_loadu_si256((const __m256i *) s));
+	_mm_sfence();
+    } else {
+	for (; d + 32 <= dend; d += 32, s += 32)
+	    _mm256_storeu_si256((__m256i *) d,
+				_mm256_loadu_si256((const __m256i *) s));
+    }
+    _mm256_storeu_si256((__m256i *) (dend - 32), last);
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *set_avx2(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    unsigned char *dend = d + n;
+    __m256i v = _mm256_set1_epi8((char) c);
+
+    if (n < 32)
+	return set_sse2(dst, c, n);
+    _mm256_storeu_si256((__m256i *) d, v);
+    if (n >= MEM_NT_THRESHOLD) {
+	d += 32 - ((uintptr_t) d & 31);
+	for (; d + 32 <= dend; d += 32)
+	    _mm256_stream_si256((__m256i *) d, v);
+	_mm_sfence();
+    } else {
+	for (; d + 32 <= dend; d += 32)
+	    _mm256_storeu_si256((__m256i *) d, v);
+    }
+    _mm256_storeu_si256((__m256i *) (dend - 32), v);
+    return dst;
+}
+#endif /* MEM_HAVE_SIMD */
+
+/* memcpy of heap data, as chosen by mem_set_copy */
+void *mem_memcpy(void *dst, const void *src, size_t n) {
+    switch (mem_copy()) {
+#ifdef MEM_HAVE_SIMD
+    case MEM_COPY_AVX2:
+	return copy_avx2(dst, src, n);
+    case MEM_COPY_SSE2:
+	return copy_sse2(dst, src, n);
+#endif
+    default:
+	return copy_emulated(dst, src, n);
+    }
+}
+
+/* memset of heap data, as chosen by mem_set_copy */
+void *mem_memset(void *dst, int c, size_t n) {
+    switch (mem_copy()) {
+#ifdef MEM_HAVE_SIMD
+    case MEM_COPY_AVX2:
+	return set_avx2(dst, c, n);
+    case MEM_COPY_SSE2:
+	return set_sse2(dst, c, n);
+#endif
+    default:
+	return set_emulated(dst, c, n);
+    }
+}
+
 /* Function to aid in viewing contents of heap */
 void hprobe(void *ptr, int offset, size_t count) {
     unsigned char *cptr = (unsigned char *) ptr;
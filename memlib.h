@@ -2,9 +2,57 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Page backing for the simulated heap */
+typedef enum {
+    MEM_PAGES_DEFAULT,  /* regular pages */
+    MEM_PAGES_THP,      /* HUGE_PAGE_SIZE aligned, madvise(MADV_HUGEPAGE) */
+    MEM_PAGES_HUGETLB   /* MEM_PAGES_THP, starting with MAP_HUGETLB pages */
+} mem_pages_t;
+
+/*
+ * Page provider: where the heap's address space comes from.
+ *   reserve  - reserve at least *len bytes, preferably at hint (NULL for
+ *              the first reservation of a heap).  May enlarge *len.
+ *              Returns NULL on failure.
+ *   commit   - make reserved pages readable and writable
+ *   decommit - drop the pages' contents; they read back as zeros
+ *   release  - give a reservation back
+ */
+typedef struct {
+    const char *name;
+    void *(*reserve)(void *hint, size_t *len);
+    bool (*commit)(void *addr, size_t len);
+    bool (*decommit)(void *addr, size_t len);
+    bool (*release)(void *addr, size_t len);
+} mem_provider_t;
+
+extern const mem_provider_t mem_provider_sim;  /* one MAX_HEAP_SIZE region (driver default) */
+extern const mem_provider_t mem_provider_sbrk; /* the real program break */
+extern const mem_provider_t mem_provider_mmap; /* anonymous mmap chunks */
+extern const mem_provider_t mem_provider_file; /* mmap of a backing file */
+
 void mem_init();               
 void mem_deinit(void);
+void mem_set_pages(mem_pages_t mode);
+mem_pages_t mem_pages(void);
+size_t mem_hugetlb_size(void);
+void mem_set_provider(const mem_provider_t *provider);
+void mem_set_backing_file(const char *path);
 void *mem_sbrk(intptr_t incr);
+bool mem_decommit(void *addr, size_t len);
+
+/* Persistent and shared heaps */
+#define MEM_ROOT_SIZE 256       /* bytes available at mem_root() */
+int mem_open_persistent(const char *path);
+int mem_shared_fd(const char *name);
+int mem_open_shared(int fd);
+bool mem_sync(void);
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+void *mem_root(void);
+size_t mem_offset(const void *p);
+void *mem_at(size_t off);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
@@ -21,6 +69,23 @@ uint64_t mem_read(const void *addr, size_t len);
 /* Require 0 <= len <= 8 */
 void mem_write(void *addr, uint64_t val, size_t len);
 
+/* How mem_memcpy and mem_memset move data */
+typedef enum {
+    MEM_COPY_AUTO,      /* the widest of the below the CPU supports */
+    MEM_COPY_EMULATED,  /* 8 bytes at a time through mem_read/mem_write */
+    MEM_COPY_SSE2,      /* 16-byte vectors */
+    MEM_COPY_AVX2       /* 32-byte vectors */
+} mem_copy_t;
+
+/* Choose how data is moved; falls back to what the CPU supports */
+void mem_set_copy(mem_copy_t mode);
+
+/* How data is moved now (never MEM_COPY_AUTO) */
+mem_copy_t mem_copy(void);
+
+/* Name of a mem_copy_t */
+const char *mem_copy_name(mem_copy_t mode);
+
 /* Emulation of memcpy */
 void *mem_memcpy(void *dst, const void *src, size_t n);
 
@@ -0,0 +1,300 @@
+/*
+ * mm-ref.c - The reference allocator that mdriver times to set the
+ * throughput targets.
+ *
+ * It is built into mdriver, so it is timed in the same process, on the
+ * same simulated heap and with the same timer as mm.c.  Segregated
+ * explicit free lists with boundary tags: every block has an 8-byte
+ * header holding its size and whether it and the block before it are
+ * allocated; free blocks also have a footer and the links of their
+ * list.  Lists hold blocks of sizes [2^(k+5), 2^(k+6)) and are searched
+ * first fit, starting from the list of the request.  Free blocks are
+ * coalesced at once.
+ *
+ * Changing it changes the reference throughput of every host, so bump
+ * REF_VERSION in mdriver.c when it does.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "memlib.h"
+#include "mmplugin.h"
+
+#define WSIZE       8               /* header and footer size */
+#define DSIZE       16              /* alignment */
+#define MIN_BLOCK   32              /* header, two links and a footer */
+#define CHUNK       4096            /* least the heap grows by */
+#define NUM_LISTS   16
+
+#define ALLOC       0x1             /* the block is allocated */
+#define PREV_ALLOC  0x2             /* the block before it is */
+
+typedef struct free_block {
+    uint64_t header;
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+static char *heap_start;            /* first block after the prologue */
+static free_block_t *lists[NUM_LISTS];
+
+static inline uint64_t *header(void *bp) {
+    return (uint64_t *) ((char *) bp - WSIZE);
+}
+
+static inline size_t block_size(void *bp) {
+    return *header(bp) & ~(uint64_t) (DSIZE - 1);
+}
+
+static inline bool is_alloc(void *bp) {
+    return *header(bp) & ALLOC;
+}
+
+static inline bool prev_alloc(void *bp) {
+    return *header(bp) & PREV_ALLOC;
+}
+
+static inline void *next_block(void *bp) {
+    return (char *) bp + block_size(bp);
+}
+
+/* Only valid when the block before bp is free */
+static inline void *prev_block(void *bp) {
+    return (char *) bp - (*(uint64_t *) ((char *) bp - DSIZE) & ~(uint64_t) (DSIZE - 1));
+}
+
+static inline void set_prev_alloc(void *bp, bool alloc) {
+    if (alloc)
+        *header(bp) |= PREV_ALLOC;
+    else
+        *header(bp) &= ~(uint64_t) PREV_ALLOC;
+}
+
+/* Write the header of an allocated block, keeping its PREV_ALLOC bit */
+static inline void mark_alloc(void *bp, size_t size) {
+    *header(bp) = size | ALLOC | (*header(bp) & PREV_ALLOC);
+    set_prev_alloc((char *) bp + size, true);
+}
+
+/* Write the header and footer of a free block */
+static inline void mark_free(void *bp, size_t size) {
+    *header(bp) = size | (*header(bp) & PREV_ALLOC);
+    *(uint64_t *) ((char *) bp + size - DSIZE) = size;
+    set_prev_alloc((char *) bp + size, false);
+}
+
+static inline int list_of(size_t size) {
+    int k = 63 - __builtin_clzll(size) - 5;
+    return k < NUM_LISTS ? k : NUM_LISTS - 1;
+}
+
+static inline free_block_t *as_free(void *bp) {
+    return (free_block_t *) header(bp);
+}
+
+static inline void *payload(free_block_t *b) {
+    return (char *) b + WSIZE;
+}
+
+static void insert(void *bp) {
+    free_block_t *b = as_free(bp);
+    int k = list_of(block_size(bp));
+    b->prev = NULL;
+    b->next = lists[k];
+    if (lists[k] != NULL)
+        lists[k]->prev = b;
+    lists[k] = b;
+}
+
+static void unlink_block(void *bp) {
+    free_block_t *b = as_free(bp);
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else
+        lists[list_of(block_size(bp))] = b->next;
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+}
+
+/* Merge the free block bp with free neighbours and list the result */
+static void *coalesce(void *bp) {
+    size_t size = block_size(bp);
+    void *next = next_block(bp);
+
+    if (!is_alloc(next)) {
+        unlink_block(next);
+        size += block_size(next);
+    }
+    if (!prev_alloc(bp)) {
+        bp = prev_block(bp);
+        unlink_block(bp);
+        size += block_size(bp);
+    }
+    mark_free(bp, size);
+    insert(bp);
+    return bp;
+}
+
+/* Grow the heap by at least size bytes; returns the new free block */
+static void *extend_heap(size_t size) {
+    char *bp;
+
+    if (size < CHUNK)
+        size = CHUNK;
+    if ((bp = mem_sbrk(size)) == (void *) -1)
+        return NULL;
+    /* the old epilogue header becomes the new block's header */
+    mark_free(bp, size);
+    *header(next_block(bp)) = ALLOC;  /* new epilogue */
+    return coalesce(bp);
+}
+
+/* Allocate asize bytes of the free block bp, freeing what is left */
+static void place(void *bp, size_t asize) {
+    size_t size = block_size(bp);
+
+    unlink_block(bp);
+    if (size - asize >= MIN_BLOCK) {
+        mark_alloc(bp, asize);
+        void *rest = next_block(bp);
+        *header(rest) = PREV_ALLOC;
+        mark_free(rest, size - asize);
+        insert(rest);
+    } else {
+        mark_alloc(bp, size);
+    }
+}
+
+static void *find_fit(size_t asize) {
+    for (int k = list_of(asize); k < NUM_LISTS; k++)
+        for (free_block_t *b = lists[k]; b != NULL; b = b->next)
+            if (block_size(payload(b)) >= asize)
+                return payload(b);
+    return NULL;
+}
+
+static inline size_t adjust(size_t size) {
+    size_t asize = (size + WSIZE + DSIZE - 1) & ~(size_t) (DSIZE - 1);
+    return asize < MIN_BLOCK ? MIN_BLOCK : asize;
+}
+
+static bool ref_init(void) {
+    char *p;
+
+    memset(lists, 0, sizeof(lists));
+    /* padding, then the prologue header and the epilogue header */
+    if ((p = mem_sbrk(2 * DSIZE)) == (void *) -1)
+        return false;
+    heap_start = p + 2 * DSIZE;
+    *(uint64_t *) (p + WSIZE) = DSIZE | ALLOC | PREV_ALLOC;  /* prologue */
+    *header(heap_start) = ALLOC | PREV_ALLOC;                 /* epilogue */
+    return true;
+}
+
+static void *ref_malloc(size_t size) {
+    size_t asize;
+    void *bp;
+
+    if (size == 0 || size > SIZE_MAX - CHUNK)
+        return NULL;
+    asize = adjust(size);
+    if ((bp = find_fit(asize)) == NULL && (bp = extend_heap(asize)) == NULL)
+        return NULL;
+    place(bp, asize);
+    return bp;
+}
+
+static void ref_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    *header(ptr) &= ~(uint64_t) ALLOC;
+    mark_free(ptr, block_size(ptr));
+    coalesce(ptr);
+}
+
+static void *ref_realloc(void *ptr, size_t size) {
+    size_t asize, cur;
+    void *next, *newp;
+
+    if (ptr == NULL)
+        return ref_malloc(size);
+    if (size == 0) {
+        ref_free(ptr);
+        return NULL;
+    }
+    asize = adjust(size);
+    cur = block_size(ptr);
+    next = next_block(ptr);
+
+    /* grow into a free neighbour, or the end of the heap */
+    if (asize > cur && !is_alloc(next) && cur + block_size(next) >= asize) {
+        unlink_block(next);
+        cur += block_size(next);
+        mark_alloc(ptr, cur);
+    } else if (asize > cur && block_size(next) == 0) {
+        if (mem_sbrk(asize - cur) == (void *) -1)
+            return NULL;
+        cur = asize;
+        mark_alloc(ptr, cur);
+        *header(next_block(ptr)) = ALLOC | PREV_ALLOC;
+    }
+    if (asize <= cur) {
+        if (cur - asize >= MIN_BLOCK) {
+            mark_alloc(ptr, asize);
+            void *rest = next_block(ptr);
+            *header(rest) = PREV_ALLOC;
+            mark_free(rest, cur - asize);
+            coalesce(rest);
+        }
+        return ptr;
+    }
+
+    if ((newp = ref_malloc(size)) == NULL)
+        return NULL;
+    mem_memcpy(newp, ptr, cur - WSIZE);
+    ref_free(ptr);
+    return newp;
+}
+
+static size_t ref_usable_size(void *ptr) {
+    return ptr == NULL ? 0 : block_size(ptr) - WSIZE;
+}
+
+static void ref_visit_free(void (*visit)(void *bp, size_t size, int size_class,
+                                         void *arg), void *arg) {
+    for (int k = 0; k < NUM_LISTS; k++)
+        for (free_block_t *b = lists[k]; b != NULL; b = b->next)
+            visit(payload(b), block_size(payload(b)), k, arg);
+}
+
+static bool ref_checkheap(int lineno) {
+    bool prev_was_alloc = true;
+    size_t free_blocks = 0, listed = 0;
+    char *bp;
+
+    for (bp = heap_start; block_size(bp) > 0; bp = next_block(bp)) {
+        if (((uintptr_t) bp % DSIZE) != 0 || prev_alloc(bp) != prev_was_alloc)
+            return false;
+        if (!is_alloc(bp)) {
+            if (!prev_was_alloc ||
+                *(uint64_t *) (bp + block_size(bp) - DSIZE) != block_size(bp))
+                return false;
+            free_blocks++;
+        }
+        prev_was_alloc = is_alloc(bp);
+    }
+    for (int k = 0; k < NUM_LISTS; k++)
+        for (free_block_t *b = lists[k]; b != NULL; b = b->next) {
+            if (is_alloc(payload(b)) || list_of(block_size(payload(b))) != k)
+                return false;
+            listed++;
+        }
+    return listed == free_blocks;
+}
+
+const mm_plugin_t mm_ref = {
+    "mm-ref", ref_init, ref_malloc, ref_free, ref_realloc, ref_usable_size,
+    ref_visit_free, ref_checkheap
+};
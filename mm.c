@@ -42,7 +42,7 @@
  *        ||: Pointer to the next and previous node.
  *        H : Headers for different free list/
  *
- *  free_node* head_list[9];
+ *  link_t head_list[MM_NUM_CLASSES];
  *  -------------------------------------------------------
  *  | H0  | H1  | H2  | H3  | H4  | H5  | H6  | H7  | H8  |
  *  ---|-----|-----|----|------|-----|-----|-----|-----|---
@@ -92,9 +92,16 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <errno.h>
+#if !defined(DRIVER) || defined(THREAD_SAFE) || defined(SHARED_HEAP)
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#ifdef MM_PLUGIN
+#include "mmplugin.h"
+#endif
 
 /*
  * If you want to enable your debugging output and heap checker code,
@@ -114,12 +121,21 @@
 #endif /* DEBUG */
 
 /* do not change the following! */
-#ifdef DRIVER
-/* create aliases for driver tests */
+#if defined(DRIVER) || defined(SHARED_HEAP)
+/* create aliases for driver tests (and keep libc malloc beside a shared heap) */
 #define malloc mm_malloc
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define malloc_usable_size mm_malloc_usable_size
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
+#endif /* DRIVER || SHARED_HEAP */
+#ifdef DRIVER
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* DRIVER */
@@ -132,21 +148,56 @@
 #define DSIZE 16 // Double word size --> from textbook
 #define CHUNKSIZE (1<<5) // Minimizing the CHUNKSIZE value to improve utilization or increase utilization ratio____//Extend heap by CHUNKSIZE amount
 
-/*global pointer that points in the middle of the Prologue block.*/
-static void* heap_listp = NULL;
+/*
+ * A link in a free list. A shared heap can be mapped at a different address
+ * in every process, so there links are offsets from the start of the heap
+ * (0 is NULL: the padding word is never a free block).
+ */
+#ifdef SHARED_HEAP
+typedef unsigned long link_t;
+#else
+typedef struct DoublyLinkedList_free_node* link_t;
+#endif
+#define NULL_LINK 0
 
 /*data structure that manages the linked list operation and this data structure to be stored inside the free block space. */
 typedef struct DoublyLinkedList_free_node{
-  struct DoublyLinkedList_free_node* prev;
-  struct DoublyLinkedList_free_node* next;
+  link_t prev;
+  link_t next;
 }free_node;
 
-/* array of pointers that store the headers that points to the segList. */
-free_node* head_list[9];
+/*
+ * The allocator's roots. They live in the header page that memlib keeps
+ * in front of the heap (mem_root()), so a persistent heap reopened at
+ * the same address finds its free lists as it left them.
+ */
+#define MM_ROOT_MAGIC 0x6d6d726f6f743031UL /* "mmroot01" */
+typedef struct {
+  unsigned long magic;  /* MM_ROOT_MAGIC once mm_init() has succeeded */
+  link_t heap_listp;    /* points in the middle of the Prologue block */
+  link_t head_list[MM_NUM_CLASSES];  /* array of pointers that store the headers that points to the segList */
+  link_t user_root;     /* set by mm_setroot() to find data after a restart */
+#ifdef SHARED_HEAP
+  pthread_mutex_t lock; /* process-shared, guards the whole heap */
+#endif
+} mm_root_t;
+
+static mm_root_t* root = NULL;
+
+#ifdef SHARED_HEAP
+/* where this process has the heap mapped */
+static char* heap_base = NULL;
+#endif
+
+#if defined(THREAD_SAFE) && !defined(SHARED_HEAP)
+/* one lock serializes every entry point of the allocator */
+static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 /* Function declaration */
 static void* extend_heap(size_t words);
+static void* new_segment(void* base, size_t size);
 static void* coalesce(void *bp);
 static void* find_fit(size_t asize);
 static void place(void* bp, size_t asize, int flag);
@@ -225,12 +276,188 @@ static size_t align(size_t x)
     return ALIGNMENT * ((x+ALIGNMENT-1)/ALIGNMENT);
 }
 
+/* Convert between links and addresses */
+static inline free_node* to_node(link_t link)
+{
+#ifdef SHARED_HEAP
+    return link == NULL_LINK ? NULL : (free_node*)(heap_base + link);
+#else
+    return link;
+#endif
+}
+static inline link_t to_link(void* p)
+{
+#ifdef SHARED_HEAP
+    return p == NULL ? NULL_LINK : (link_t)((char*)p - heap_base);
+#else
+    return p;
+#endif
+}
+
+/* Unlock the allocator; compiles away without THREAD_SAFE */
+static inline void mm_unlock(void)
+{
+#ifdef SHARED_HEAP
+    pthread_mutex_unlock(&root->lock);
+#elif defined(THREAD_SAFE)
+    pthread_mutex_unlock(&mm_mutex);
+#endif
+}
+
+#if !defined(DRIVER) && !defined(SHARED_HEAP)
+/*
+ * Without the driver nobody calls mem_init() and mm_init() for us, so
+ * the first request does it. MM_PROVIDER picks the page provider
+ * (mmap, sbrk or file) or "persist" for a persistent heap, and
+ * MM_HEAP_FILE the file used by "file" and "persist". A process that
+ * finds the persistent heap in use gets an ordinary heap instead.
+ */
+static bool mm_start(void)
+{
+    const char* name = getenv("MM_PROVIDER");
+    const char* file = getenv("MM_HEAP_FILE");
+
+    if (name != NULL && strcmp(name, "sbrk") == 0)
+    {
+        mem_set_provider(&mem_provider_sbrk);
+    }
+    else if (name != NULL && strcmp(name, "file") == 0)
+    {
+        mem_set_provider(&mem_provider_file);
+    }
+    if (file != NULL)
+    {
+        mem_set_backing_file(file);
+    }
+    if (name != NULL && strcmp(name, "persist") == 0)
+    {
+        if (mem_open_persistent(file) >= 0)
+        {
+            return mm_attach();
+        }
+        /* the heap belongs to another process, e.g. the one that ran us */
+        if (errno != EBUSY)
+        {
+            return false;
+        }
+    }
+    mem_init();
+    return mm_init();
+}
+
+/*
+ * Keep the lock usable in the child of a fork(), and let memlib give
+ * the child a heap of its own while nobody can change the parent's
+ */
+static void mm_atfork_prepare(void)
+{
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&mm_mutex);
+#endif
+    mem_fork_prepare();
+}
+static void mm_atfork_parent(void)
+{
+    mem_fork_parent();
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&mm_mutex);
+#endif
+}
+static void mm_atfork_child(void)
+{
+    mem_fork_child();
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&mm_mutex);
+#endif
+}
+static void __attribute__((constructor)) mm_register_atfork(void)
+{
+    pthread_atfork(mm_atfork_prepare, mm_atfork_parent, mm_atfork_child);
+}
+#endif /* !DRIVER && !SHARED_HEAP */
+
+/*
+ * Returns false if the heap could not be set up on first use. A shared
+ * heap has to be attached with mm_attach() before it is used, which
+ * mm_lock() checks.
+ */
+static inline bool mm_ready(void)
+{
+#if !defined(DRIVER) && !defined(SHARED_HEAP)
+    if (root == NULL)
+    {
+        return mm_start();
+    }
+#endif
+    return true;
+}
+
+/*
+ * Lock the allocator and make sure the heap exists. Returns false, with
+ * the lock not held, if there is no usable heap: a shared heap that was
+ * not attached, or whose initialization failed, has no lock to take.
+ * The locks compile away without THREAD_SAFE.
+ */
+static inline bool mm_lock(void)
+{
+#ifdef SHARED_HEAP
+    if (root == NULL || root->magic != MM_ROOT_MAGIC)
+    {
+        return false;
+    }
+    /* the owner died holding the lock; its last operation may be torn */
+    if (pthread_mutex_lock(&root->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&root->lock);
+    }
+#elif defined(THREAD_SAFE)
+    pthread_mutex_lock(&mm_mutex);
+#endif
+    if (!mm_ready())
+    {
+        mm_unlock();
+        return false;
+    }
+    return true;
+}
+
+#ifdef SHARED_HEAP
+/* The lock lives in the heap, so it has to work across processes */
+static bool init_shared_lock(void)
+{
+    pthread_mutexattr_t attr;
+    bool ok;
+
+    if (pthread_mutexattr_init(&attr) != 0)
+    {
+        return false;
+    }
+    ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+         pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+         pthread_mutex_init(&root->lock, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return ok;
+}
+#endif /* SHARED_HEAP */
+
 /*
  * Initialize: returns false on error, true on success.(From TEXTBOOK: COMPUTER SYSTEMS)
  */
 bool mm_init(void)
 {
     /* IMPLEMENT THIS */
+    void* heap_listp;
+
+    root = mem_root();
+    root->magic = 0;
+    root->user_root = NULL_LINK;
+#ifdef SHARED_HEAP
+    heap_base = mem_heap_lo();
+    if (!init_shared_lock())
+    {
+        return false;
+    }
+#endif
   
     /* Initializes all the heads of the seg lists to NULL */
     segList_init();
@@ -245,14 +472,73 @@ bool mm_init(void)
     PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 3));
     PUT(heap_listp + (3*WSIZE), PACK(0, 3));
     /* points at the mid of the prologue block or at footer of PB. */
-    heap_listp = heap_listp + 2*WSIZE;
+    root->heap_listp = to_link(heap_listp + 2*WSIZE);
     
     /* Now extending the heap to create a CHUNK for the data */
     if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
         return false;
+    root->magic = MM_ROOT_MAGIC;
     return true;
 }
 
+/*
+ * Picks up a heap reopened with mem_open_persistent() or mem_open_shared():
+ * if its header page holds our roots, the free lists and allocated blocks
+ * are used as they are; otherwise the heap is emptied and initialized.
+ * With a shared heap, the process that creates it must attach before
+ * any other process does.
+ */
+bool mm_attach(void)
+{
+    root = mem_root();
+#ifdef SHARED_HEAP
+    heap_base = mem_heap_lo();
+#endif
+    if (root->magic == MM_ROOT_MAGIC && root->heap_listp != NULL_LINK)
+    {
+        return true;
+    }
+    mem_reset_brk();
+    return mm_init();
+}
+
+/*
+ * Flushes the heap and its roots to the backing file. Changes made after
+ * the last checkpoint may be lost, or partly applied, if the process dies.
+ */
+bool mm_checkpoint(void)
+{
+    bool ok;
+    if (!mm_lock())
+    {
+        return false;
+    }
+    ok = mem_sync();
+    mm_unlock();
+    return ok;
+}
+
+/* Remember one pointer, e.g. to a cache's index, across restarts */
+void mm_setroot(void* ptr)
+{
+    if (mm_lock())
+    {
+        root->user_root = to_link(ptr);
+        mm_unlock();
+    }
+}
+
+void* mm_getroot(void)
+{
+    void* ptr = NULL;
+    if (mm_lock())
+    {
+        ptr = to_node(root->user_root);
+        mm_unlock();
+    }
+    return ptr;
+}
+
 /*
  * function to extend the heap --> extend_heap(COMPUTER SYSTEMS TEXTBOOK)
  */
@@ -260,10 +546,20 @@ static void* extend_heap(size_t words)
 {
     void* bp;
     size_t size;
+    void* brk = (char*)mem_heap_hi() + 1;
 
     size = (words%2) ? (words+1)*WSIZE : words*WSIZE; 
     if ((bp = mem_sbrk(size)) == (void *)-1)
         return NULL;
+
+    /* the page provider could not grow the heap in place */
+    if (bp != brk)
+    {
+        /* grab room for the new segment's padding, prologue and epilogue */
+        if (mem_sbrk(4*WSIZE) == (void *)-1)
+            return NULL;
+        return new_segment(bp, size + 4*WSIZE);
+    }
   
     /*to get the allocation of the block prior to the epilB.*/
     unsigned long prevalloc = GET_PREV_ALLOC(HDRP(bp));
@@ -274,24 +570,48 @@ static void* extend_heap(size_t words)
     return coalesce(bp);
 }
 
+/*
+ * Lays out a segment that is not contiguous with the rest of the heap
+ * the same way mm_init() lays out the first one: a padding word and a
+ * prologue block, then a single free block and an epilogue block.
+ * The epilogue of the previous segment stays in place, so blocks are
+ * never coalesced across segments.
+ */
+static void* new_segment(void* base, size_t size)
+{
+    void* bp = (char*)base + 4*WSIZE;
+    size_t bsize = size - 4*WSIZE;
+
+    PUT(base, 0);
+    PUT((char*)base + (1*WSIZE), PACK(DSIZE, 1));
+    PUT((char*)base + (2*WSIZE), PACK(DSIZE, 3));
+    PUT(HDRP(bp), PACK(bsize, 2));
+    PUT(FTRP(bp), PACK(bsize, 2));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* EPILOGUE */
+
+    return coalesce(bp);
+}
+
 /*
  * SEG LIST INITIALIZER AND ALLOCATOR
  */
 
 void segList_init()
 {
-  for (int i = 0; i <= 8; i++)
+  for (int i = 0; i < MM_NUM_CLASSES; i++)
   {
-    head_list[i] = NULL;
+    root->head_list[i] = NULL_LINK;
   }
 }
 
+_Static_assert(MM_NUM_CLASSES == 9, "segList_alloc splits sizes into nine classes");
+
 /* returns the index of the head that points to a particular linked list according to the size requested */
 int segList_alloc(size_t size)
 {
   if (size >= 8193)
   {
-    return 8;
+    return MM_NUM_CLASSES - 1;
   }
   else if (size == 32 || size == 60)
   {
@@ -332,53 +652,53 @@ int segList_alloc(size_t size)
  */
 
 /* Pushing at the head */
-static void push_node(free_node** head, free_node* node)
+static void push_node(link_t* head, free_node* node)
 {
-  node->prev = NULL;
+  node->prev = NULL_LINK;
   node->next = *head;
-  if (*head != NULL)
+  if (*head != NULL_LINK)
   {
-    (*head)->prev = node;
+    to_node(*head)->prev = to_link(node);
   }
-  *head = node;
+  *head = to_link(node);
   return;
 }
 
-static void delete_node(free_node** head, free_node* node)
+static void delete_node(link_t* head, free_node* node)
 {
   /* if the node to be deleted is the 1st node then make the head point to the next node */
-  if (*head == node)
+  if (*head == to_link(node))
   {
     *head = node->next;
   }
   
   /* if the node next to the one that is to be deleted is not null then set the previous pointer of the next node */
-  if (node->next != NULL)
+  if (node->next != NULL_LINK)
   {
-    node->next->prev = node->prev;
+    to_node(node->next)->prev = node->prev;
   }
   
   /* if the node before the node that is to be deleted is not null then set next of the previous node */
-  if (node->prev != NULL)
+  if (node->prev != NULL_LINK)
   {
-    node->prev->next = node->next;
+    to_node(node->prev)->next = node->next;
   }
   return;
 }
 
 /* For Debugging purposes */
-static int count_node(free_node** head)
+static int count_node(link_t* head)
 {
   int cnt = 0;
-  if (*head == NULL)
+  if (*head == NULL_LINK)
   {
     printf("Total free blocks = %d\n", cnt);
     return cnt;
   }
-  free_node* iter = *head;
+  free_node* iter = to_node(*head);
   while (iter != NULL)
   {
-    iter = iter->next;
+    iter = to_node(iter->next);
     cnt = cnt + 1;
   }
   printf("Total free blocks = %d\n", cnt);
@@ -414,7 +734,7 @@ static void* coalesce(void* bp)
         PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 1));  //M
         /* gives the head for the list of the appropriate size */
         ch = segList_alloc(size);
-        push_node(&head_list[ch], bp);
+        push_node(&root->head_list[ch], bp);
         return bp;
     }
 
@@ -427,7 +747,7 @@ static void* coalesce(void* bp)
     else if (prev_alloc && !next_alloc)
     {
         ch = segList_alloc(nextb_size);
-        delete_node(&head_list[ch], nextblk);
+        delete_node(&root->head_list[ch], nextblk);
         size = size + GET_SIZE(HDRP(NEXT_BLKP(bp)));
     
         PUT(HDRP(bp), PACK(size, 2));
@@ -436,7 +756,7 @@ static void* coalesce(void* bp)
         /* also to let the next block know that the previous block is free  M */
         PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 1));
         ch = segList_alloc(size);
-        push_node(&head_list[ch], bp);
+        push_node(&root->head_list[ch], bp);
     }
 
     /*
@@ -449,7 +769,7 @@ static void* coalesce(void* bp)
     {
         size_t prevb_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
         ch = segList_alloc(prevb_size);
-        delete_node(&head_list[ch], prevblk);
+        delete_node(&root->head_list[ch], prevblk);
         size = size + GET_SIZE(HDRP(PREV_BLKP(bp)));
         PUT(FTRP(bp), PACK(size, 2));
         PUT(HDRP(PREV_BLKP(bp)), PACK(size, 2));
@@ -457,7 +777,7 @@ static void* coalesce(void* bp)
         PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 1));
         bp = PREV_BLKP(bp);
         ch = segList_alloc(size);
-        push_node(&head_list[ch], bp);
+        push_node(&root->head_list[ch], bp);
     }
 
     /*
@@ -470,9 +790,9 @@ static void* coalesce(void* bp)
     {
         size_t prevb_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
         ch = segList_alloc(nextb_size);
-        delete_node(&head_list[ch], nextblk);
+        delete_node(&root->head_list[ch], nextblk);
         ch = segList_alloc(prevb_size);
-        delete_node(&head_list[ch], prevblk);
+        delete_node(&root->head_list[ch], prevblk);
         size = size + GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
         PUT(HDRP(PREV_BLKP(bp)), PACK(size, 2));
         PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 2));
@@ -480,7 +800,7 @@ static void* coalesce(void* bp)
         PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 1));
         bp = PREV_BLKP(bp);
         ch = segList_alloc(size);
-        push_node(&head_list[ch], bp);
+        push_node(&root->head_list[ch], bp);
     }
     
     return bp;
@@ -495,12 +815,12 @@ static void* find_fit(size_t asize)  /* MODIFIED FIND FIT FOR SEGREGATED FREE LI
 {
   
   int ch = segList_alloc(asize);
-  free_node* iter = head_list[ch];
+  free_node* iter = to_node(root->head_list[ch]);
   
   /* to go to other segregated free list */
-  while (ch <= 8)
+  while (ch < MM_NUM_CLASSES)
   {
-      iter = head_list[ch];
+      iter = to_node(root->head_list[ch]);
       /* traverses a free list */
       while (iter != NULL)
       {
@@ -508,7 +828,7 @@ static void* find_fit(size_t asize)  /* MODIFIED FIND FIT FOR SEGREGATED FREE LI
           {
               return (void*)(iter);
           }
-          iter = iter -> next;
+          iter = to_node(iter -> next);
       }
       ch = ch + 1;
   }
@@ -538,13 +858,13 @@ static void place(void *bp, size_t asize, int flag)
         if (flag)
         {
             ch = segList_alloc(csize);
-            delete_node(&head_list[ch], bp);
+            delete_node(&root->head_list[ch], bp);
             PUT(HDRP(bp), PACK(asize, 3));
             bp = NEXT_BLKP(bp);
             PUT(HDRP(bp), PACK(csize-asize, 2));
             PUT(FTRP(bp), PACK(csize-asize, 2));
             ch = segList_alloc(diff);
-            push_node(&head_list[ch], bp);
+            push_node(&root->head_list[ch], bp);
         }
       
         /* Handling calls from realloc() */
@@ -567,7 +887,7 @@ static void place(void *bp, size_t asize, int flag)
         {
             PUT(HDRP(NEXT_BLKP(bp)), PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))), 3));
             ch = segList_alloc(csize);
-            delete_node(&head_list[ch], bp);
+            delete_node(&root->head_list[ch], bp);
             PUT(HDRP(bp), PACK(csize, 3));
         }
         else
@@ -581,7 +901,7 @@ static void place(void *bp, size_t asize, int flag)
 /*
  * malloc(FROM TB: COMPUTER SYSTEMS)
  */
-void* malloc(size_t size)
+static void* do_malloc(size_t size)
 {
     /* IMPLEMENT THIS */
     //dbg_printf("BEFORE ALLOCATION\n");
@@ -593,23 +913,26 @@ void* malloc(size_t size)
 
     if (size == 0)
     {
+#ifdef DRIVER
         return NULL;
-    }
-  
-    if (size <= DSIZE)
-    {
-        /*
-         * Minimum size has to be 32 Bytes to accomodate
-         * next pointer, prev pointer, and the footer space
-         */
-        asize = 2*DSIZE;
+#else
+        /* real programs expect a unique pointer from malloc(0) */
+        size = 1;
+#endif
     }
 
-    else
+    /* guard against overflow when the header is added */
+    if (size > SIZE_MAX - DSIZE - ALIGNMENT)
     {
-      asize = align(size+WSIZE);
+        return NULL;
     }
   
+    /*
+     * Minimum size has to be 32 Bytes to accomodate
+     * next pointer, prev pointer, and the footer space
+     */
+    asize = mm_block_size(size);
+  
 
     if ((bp = find_fit(asize)) != NULL)
     {
@@ -633,9 +956,14 @@ void* malloc(size_t size)
 /*
  * free(FROM TB: COMPUTER SYSTEMS)
  */
-void free(void* ptr)
+static void do_free(void* ptr)
 {
     /* IMPLEMENT THIS */
+    if (ptr == NULL)
+    {
+        return;
+    }
+
     size_t size = GET_SIZE(HDRP(ptr));
     /* to get the allocation of the block prior to the epilB. */
     unsigned long prevalloc = GET_PREV_ALLOC(HDRP(ptr)); // M
@@ -648,17 +976,22 @@ void free(void* ptr)
 /*
  * realloc
  */
-void* realloc(void* oldptr, size_t size)
+static void* do_realloc(void* oldptr, size_t size)
 {
     /* IMPLEMENT THIS */
     if (oldptr == NULL)
     {
-        return malloc(size);
+        return do_malloc(size);
     }
 
     if (size == 0 && oldptr != NULL)
     {
-        free(oldptr);
+        do_free(oldptr);
+        return NULL;
+    }
+
+    if (size > SIZE_MAX - DSIZE - ALIGNMENT)
+    {
         return NULL;
     }
 
@@ -678,15 +1011,7 @@ void* realloc(void* oldptr, size_t size)
 
         else
         {
-            if (new_size <= DSIZE)
-            {
-                asize = 2*DSIZE;
-            }
-
-            else
-            {
-              asize = align(new_size+WSIZE); //+ DSIZE;  M
-            }
+            asize = mm_block_size(new_size);
         }
         
         place(oldptr, asize, flag);
@@ -695,32 +1020,238 @@ void* realloc(void* oldptr, size_t size)
 
     else
     {
-        void* bp_new = malloc(new_size);
+        void* bp_new = do_malloc(new_size);
         if (bp_new)
         {
             memcpy(bp_new, oldptr, old_size);
-            free(oldptr);
+            do_free(oldptr);
         }
         return bp_new;
     }
     return NULL;
 }
 
+/*
+ * memalign
+ * Over-allocates so that an aligned payload fits with room for a free
+ * block in front of it, gives the front back to the free lists and
+ * trims the tail with place().
+ */
+static void* do_memalign(size_t alignment, size_t size)
+{
+    char* bp;
+    char* p;
+    size_t asize;
+
+    if (alignment <= ALIGNMENT)
+    {
+        return do_malloc(size);
+    }
+    if (size > SIZE_MAX - alignment - 4*DSIZE)
+    {
+        return NULL;
+    }
+    if ((bp = do_malloc(size + alignment + 2*DSIZE)) == NULL)
+    {
+        return NULL;
+    }
+
+    p = bp;
+    if ((uintptr_t)p % alignment != 0)
+    {
+        /* the front has to be at least a minimum sized free block */
+        uintptr_t q = (uintptr_t)bp + 2*DSIZE + alignment - 1;
+        p = (char*)(q - q % alignment);
+
+        size_t front = p - bp;
+        size_t total = GET_SIZE(HDRP(bp));
+        unsigned long prevalloc = GET_PREV_ALLOC(HDRP(bp));
+        PUT(HDRP(p), PACK(total - front, 1));
+        PUT(HDRP(bp), PACK(front, 0|prevalloc<<1));
+        PUT(FTRP(bp), PACK(front, 0|prevalloc<<1));
+        coalesce(bp);
+    }
+
+    asize = mm_block_size(size);
+    if (GET_SIZE(HDRP(p)) > asize)
+    {
+        place(p, asize, 0);
+    }
+    return p;
+}
+
 /*
  * calloc
  * This function is not tested by mdriver, and has been implemented for you.
  */
-void* calloc(size_t nmemb, size_t size)
+static void* do_calloc(size_t nmemb, size_t size)
 {
     void* ptr;
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+    {
+        return NULL;
+    }
     size *= nmemb;
-    ptr = malloc(size);
+    ptr = do_malloc(size);
     if (ptr) {
         memset(ptr, 0, size);
     }
     return ptr;
 }
 
+/*
+ * Public entry points: take the lock and make sure the heap exists,
+ * then hand off to the do_*() functions above.
+ */
+void* malloc(size_t size)
+{
+    void* bp = NULL;
+    if (mm_lock())
+    {
+        bp = do_malloc(size);
+        mm_unlock();
+    }
+    if (bp == NULL && size != 0)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+void free(void* ptr)
+{
+    if (ptr != NULL && mm_lock())
+    {
+        do_free(ptr);
+        mm_unlock();
+    }
+}
+
+void* realloc(void* oldptr, size_t size)
+{
+    void* bp = NULL;
+    if (mm_lock())
+    {
+        bp = do_realloc(oldptr, size);
+        mm_unlock();
+    }
+    if (bp == NULL && size != 0)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    void* bp = NULL;
+    if (mm_lock())
+    {
+        bp = do_calloc(nmemb, size);
+        mm_unlock();
+    }
+    if (bp == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+void* reallocarray(void* oldptr, size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(oldptr, nmemb * size);
+}
+
+/* Bytes usable in the block: allocated blocks have no footer */
+size_t malloc_usable_size(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    void* bp = NULL;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (mm_lock())
+    {
+        bp = do_memalign(alignment, size);
+        mm_unlock();
+    }
+    if (bp == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    void* bp;
+    /* a power of two multiple of sizeof(void*), checked before allocating */
+    if (alignment == 0 || alignment % sizeof(void*) != 0 ||
+        (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    if ((bp = memalign(alignment, size)) == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+void* pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/*
+ * mm_visit_free - Calls visit on every free block, with its payload
+ * address, its size in bytes (header included) and the index of the
+ * free list it is on. The heap is locked meanwhile, so visit must not
+ * call back into the allocator.
+ */
+void mm_visit_free(mm_visit_fn visit, void* arg)
+{
+    if (mm_lock())
+    {
+        for (int ch = 0; ch < MM_NUM_CLASSES; ch++)
+        {
+            for (free_node* iter = to_node(root->head_list[ch]); iter != NULL;
+                 iter = to_node(iter->next))
+            {
+                visit(iter, GET_SIZE(HDRP(iter)), ch, arg);
+            }
+        }
+        mm_unlock();
+    }
+}
+
 /*
  * Returns whether the pointer is in the heap.
  * May be useful for debugging.
@@ -750,9 +1281,9 @@ bool mm_checkheap(int lineno)
     /* IMPLEMENT THIS */
     void* bp;
 
-    for(bp = heap_listp; GET_SIZE(HDRP(bp))>0; bp = NEXT_BLKP(bp))
+    for(bp = to_node(root->heap_listp); GET_SIZE(HDRP(bp))>0; bp = NEXT_BLKP(bp))
     {
-      if (bp == heap_listp)
+      if (bp == to_node(root->heap_listp))
       {
        // dbg_printf("\n H: %p\tbp: %p\tF: %p\tSize: %lu\tA: %lu\tPA: %lu  <-- PROLOGUE BLOCK\n",HDRP(bp), bp, FTRP(bp), GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)));
         continue;
@@ -778,9 +1309,9 @@ bool mm_checkheap(int lineno)
   
     //dbg_printf("\nSEGREGATED LINKED LISTS\n");
     int ch = 0;
-    while (ch <= 8)
+    while (ch < MM_NUM_CLASSES)
     {
-      free_node* iter = head_list[ch];
+      free_node* iter = to_node(root->head_list[ch]);
       //dbg_printf("\nLINKED LIST %d\n", ch+1);
    
       while(iter != NULL)
@@ -793,7 +1324,7 @@ bool mm_checkheap(int lineno)
          * then we get an error message and the program is Aborted.
          */
         dbg_assert(GET(HDRP(bp)) == GET(FTRP(bp)));
-        iter = iter -> next;
+        iter = to_node(iter -> next);
       }
       ch = ch + 1;
     }
@@ -802,3 +1333,11 @@ bool mm_checkheap(int lineno)
 #endif /* DEBUG */
     return true;
 }
+
+#ifdef MM_PLUGIN
+/* Lets mdriver -A load this build of mm.c beside the one it links */
+const mm_plugin_t mm_plugin = {
+    "mm", mm_init, malloc, free, realloc, malloc_usable_size, mm_visit_free,
+    mm_checkheap
+};
+#endif
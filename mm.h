@@ -1,13 +1,20 @@
 #include <stdio.h>
 #include <stdbool.h>
 
-#ifdef DRIVER
+#if defined(DRIVER) || defined(SHARED_HEAP)
 
-/* declare functions for driver tests */
+/* declare functions for driver tests and shared heaps */
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
 
 #else
 
@@ -16,10 +23,37 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Persistent heaps: reopen with mem_open_persistent() then mm_attach() */
+extern bool mm_attach(void);
+extern bool mm_checkpoint(void);
+extern void mm_setroot(void *ptr);
+extern void *mm_getroot(void);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
+
+/* Size of the block that holds a size-byte request: the payload and its
+   header word rounded up to 16 bytes, and at least 32 bytes so that the
+   block can hold the free-list links and footer once it is freed */
+static inline size_t mm_block_size(size_t size)
+{
+    return (size <= 16) ? 32 : (size + 8 + 15) / 16 * 16;
+}
+
+/* Heap introspection: visit(bp, size, size_class, arg) is called for every
+   free block, size_class being its free list (0 to MM_NUM_CLASSES - 1) */
+#define MM_NUM_CLASSES 9
+typedef void (*mm_visit_fn)(void *bp, size_t size, int size_class, void *arg);
+extern void mm_visit_free(mm_visit_fn visit, void *arg);
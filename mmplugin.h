@@ -0,0 +1,31 @@
+/*
+ * Interface of an allocator plugin for mdriver -A
+ *
+ * A plugin is a shared object that defines one mm_plugin_t named
+ * mm_plugin.  Like mm.c, it must get its memory from the driver's
+ * mem_sbrk() (mdriver exports memlib to plugins), so its blocks can be
+ * validated against the heap and its utilization measured the same way.
+ * init is called on an empty heap before every run of a trace.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MM_PLUGIN_SYMBOL "mm_plugin"
+
+typedef struct {
+    const char *name;
+    bool (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+
+    /* Optional, may be NULL: -F needs usable_size and visit_free, -U
+       needs visit_free for its free list columns, and -D checkheap */
+    size_t (*usable_size)(void *ptr);
+    void (*visit_free)(void (*visit)(void *bp, size_t size, int size_class,
+                                     void *arg), void *arg);
+    bool (*checkheap)(int lineno);
+} mm_plugin_t;
+
+/* The reference allocator built into mdriver (mm-ref.c) */
+extern const mm_plugin_t mm_ref;
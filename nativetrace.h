@@ -0,0 +1,49 @@
+/*
+ * Interface of a trace compiled to native code by rep2c
+ *
+ * The generated file defines one native_trace_t named native_trace.
+ * Its run function makes every request of the trace as a direct call
+ * to mm_malloc, mm_realloc or mm_free, keeping the blocks in a caller
+ * provided array of num_ids pointers; the mm_* symbols are resolved
+ * against mdriver when it loads the compiled trace with -X.
+ */
+#include <stddef.h>
+#include "tracebin.h"
+
+#define NATIVE_TRACE_SYMBOL "native_trace"
+
+typedef struct {
+    const char *trace;          /* file the trace was compiled from */
+    int num_ids;
+    long num_ops;
+    void (*run)(void **blocks);
+} native_trace_t;
+
+extern void *mm_malloc(size_t size);
+extern void mm_free(void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+
+/*
+ * Replay the n requests at ops, whose big sizes are in big.  The
+ * generated run function inlines this over its request table, so the
+ * loop makes direct calls and touches nothing but the packed requests
+ * and the block pointers.
+ */
+static inline void native_replay(const tracebin_op_t *ops, long n,
+                                 const uint64_t *big, void **p)
+{
+    const tracebin_op_t *op, *end = ops + n;
+
+    for (op = ops; op < end; op++) {
+        switch (op->type) {
+        case TRACE_ALLOC:
+            p[op->index] = mm_malloc(tracebin_size(op, big));
+            break;
+        case TRACE_REALLOC:
+            p[op->index] = mm_realloc(p[op->index], tracebin_size(op, big));
+            break;
+        default:
+            mm_free(op->index < 0 ? NULL : p[op->index]);
+        }
+    }
+}
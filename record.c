@@ -0,0 +1,694 @@
+/*
+ * record.c - LD_PRELOAD shim that records the allocations of a real
+ *            program as a trace for mdriver
+ *
+ *     LD_PRELOAD=$PWD/librecord.so MM_RECORD_FILE=app.rep <program>
+ *
+ * Every malloc-family call is passed on to the next allocator and
+ * logged as an event stamped with a global sequence number.  Events go
+ * to a per-thread buffer without any locking; full buffers are pushed
+ * on a lock-free list and spilled to a raw file by a writer thread.
+ * When the program exits, the events are sorted by sequence number,
+ * addresses are renamed to compact block ids (reused once freed), and
+ * the trace is written as a .rep file, or in the binary format if the
+ * file name ends in ".bin".  Blocks still live at exit are freed at the
+ * end of the trace, as mdriver expects.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracebin.h"
+
+#define RECORD_FILE       "./mm_record.rep"
+#define RECORD_BUF_EVENTS 4096          /* events per thread buffer */
+#define BOOTSTRAP_BYTES   (1 << 16)     /* for allocations made by dlsym */
+#define WRITER_NAP_NSECS  1000000       /* writer polls every millisecond */
+
+/*
+ * To keep the recorded order replayable across threads, allocations
+ * take their sequence number after the call returns and frees take it
+ * before the call, so an address is never handed out again before the
+ * free that released it.  A realloc logs both halves.
+ */
+typedef enum {
+    EV_MALLOC,          /* ptr = new block, size */
+    EV_FREE,            /* ptr = freed block */
+    EV_REALLOC_BEGIN,   /* ptr = old block, which may be released now */
+    EV_REALLOC_END      /* ptr = new block, old = old block, size */
+} event_type_t;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t type;
+    uintptr_t ptr;
+    uintptr_t old;
+    uint64_t size;
+} event_t;
+
+typedef struct rec_buf {
+    struct rec_buf *next;       /* on the list of full buffers */
+    size_t count;
+    event_t events[RECORD_BUF_EVENTS];
+} rec_buf_t;
+
+/*
+ * Every recording thread, so that exit can flush partial buffers.
+ * active is set while the thread appends to buf, and exit waits for it
+ * to clear before it takes the buffer.
+ */
+typedef struct rec_thread {
+    struct rec_thread *next;
+    rec_buf_t *_Atomic buf;
+    atomic_int active;
+} rec_thread_t;
+
+/* The allocator being recorded */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_valloc)(size_t);
+static void *(*real_pvalloc)(size_t);
+
+static unsigned char bootstrap[BOOTSTRAP_BYTES] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+
+static atomic_bool recording = false;
+static atomic_uint_fast64_t next_seq = 0;
+static rec_buf_t *_Atomic full_bufs = NULL;
+static rec_thread_t *_Atomic threads = NULL;
+static atomic_bool writer_stop = false;
+static pthread_t writer;
+static pthread_key_t thread_key;
+static pid_t owner;
+static int raw_fd = -1;
+static char raw_path[4096];
+static const char *out_path;
+
+static __thread rec_thread_t *self;
+static __thread int busy;       /* inside the recorder: do not record */
+
+/*
+ * bootstrap_alloc - serve allocations made while dlsym is resolving
+ *                   the real allocator
+ */
+static void *bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    if (bootstrap_used + size > BOOTSTRAP_BYTES)
+	return NULL;
+    bootstrap_used += size;
+    return bootstrap + bootstrap_used - size;
+}
+
+static int is_bootstrap(void *p) {
+    return (unsigned char *) p >= bootstrap &&
+	(unsigned char *) p < bootstrap + BOOTSTRAP_BYTES;
+}
+
+static void resolve(void) {
+    static int resolving = 0;
+    if (real_malloc != NULL || resolving)
+	return;
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_valloc = dlsym(RTLD_NEXT, "valloc");
+    real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+    resolving = 0;
+}
+
+/*
+ * push_full - hand a buffer to the writer thread
+ */
+static void push_full(rec_buf_t *buf) {
+    buf->next = atomic_load(&full_bufs);
+    while (!atomic_compare_exchange_weak(&full_bufs, &buf->next, buf))
+	;
+}
+
+/* Once recording stops, leave the buffer to record_finish (see log_event) */
+static void thread_exit(void *arg) {
+    rec_thread_t *t = arg;
+    rec_buf_t *buf;
+    atomic_store(&t->active, 1);
+    if (atomic_load(&recording) && (buf = atomic_exchange(&t->buf, NULL)) != NULL)
+	push_full(buf);
+    atomic_store_explicit(&t->active, 0, memory_order_release);
+}
+
+/*
+ * log_event - append an event to this thread's buffer.  Once recording
+ *             stops, record_finish owns the buffers, so the thread only
+ *             touches its buffer while it is marked active and
+ *             recording is still on (record_finish clears recording,
+ *             then waits for active to clear).
+ */
+static void log_event(uint64_t seq, event_type_t type, void *ptr, void *old,
+		      size_t size) {
+    rec_buf_t *buf;
+    event_t *ev;
+
+    busy++;
+    if (self == NULL) {
+	if ((self = real_calloc(1, sizeof(rec_thread_t))) == NULL)
+	    goto out;
+	self->next = atomic_load(&threads);
+	while (!atomic_compare_exchange_weak(&threads, &self->next, self))
+	    ;
+	pthread_setspecific(thread_key, self);
+    }
+    atomic_store(&self->active, 1);
+    if (!atomic_load(&recording))
+	goto done;
+    buf = atomic_load(&self->buf);
+    if (buf == NULL || buf->count == RECORD_BUF_EVENTS) {
+	if (buf != NULL)
+	    push_full(buf);
+	if ((buf = real_malloc(sizeof(rec_buf_t))) != NULL)
+	    buf->count = 0;
+	atomic_store(&self->buf, buf);
+	if (buf == NULL)
+	    goto done;
+    }
+    ev = &buf->events[buf->count++];
+    ev->seq = seq;
+    ev->type = type;
+    ev->ptr = (uintptr_t) ptr;
+    ev->old = (uintptr_t) old;
+    ev->size = size;
+done:
+    atomic_store_explicit(&self->active, 0, memory_order_release);
+out:
+    busy--;
+}
+
+static inline int should_record(void) {
+    return busy == 0 && atomic_load_explicit(&recording, memory_order_relaxed);
+}
+
+static inline uint64_t take_seq(void) {
+    return atomic_fetch_add(&next_seq, 1);
+}
+
+/*
+ * The malloc family
+ */
+void *malloc(size_t size) {
+    void *p;
+    resolve();
+    if (real_malloc == NULL)
+	return bootstrap_alloc(size);
+    p = real_malloc(size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+    void *p;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    resolve();
+    if (real_calloc == NULL)
+	return bootstrap_alloc(total);          /* static, so already zero */
+    p = real_calloc(nmemb, size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, total);
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || is_bootstrap(ptr))
+	return;
+    resolve();
+    if (should_record())
+	log_event(take_seq(), EV_FREE, ptr, NULL, 0);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *p;
+    int rec;
+
+    resolve();
+    if (ptr != NULL && is_bootstrap(ptr)) {
+	/* moving out of the bootstrap area: the old size is unknown,
+	   but the block ends by the end of the area handed out */
+	size_t avail = bootstrap + bootstrap_used - (unsigned char *) ptr;
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, size < avail ? size : avail);
+	return p;
+    }
+    if (real_realloc == NULL)
+	return bootstrap_alloc(size);
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    rec = should_record();
+    if (rec)
+	log_event(take_seq(), EV_REALLOC_BEGIN, ptr, NULL, 0);
+    p = real_realloc(ptr, size);
+    if (rec)
+	log_event(take_seq(), EV_REALLOC_END, p != NULL ? p : ptr, ptr,
+		  p != NULL ? size : 0);
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    int err;
+    resolve();
+    err = real_posix_memalign(memptr, alignment, size);
+    if (err == 0 && should_record())
+	log_event(take_seq(), EV_MALLOC, *memptr, NULL, size);
+    return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *p;
+    resolve();
+    p = real_aligned_alloc(alignment, size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p;
+    resolve();
+    p = real_memalign(alignment, size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *valloc(size_t size) {
+    void *p;
+    resolve();
+    p = real_valloc(size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *pvalloc(size_t size) {
+    void *p;
+    resolve();
+    p = real_pvalloc(size);
+    if (p != NULL && should_record())
+	log_event(take_seq(), EV_MALLOC, p, NULL, size);
+    return p;
+}
+
+/* libc's reallocarray calls its own realloc, so it must be caught too */
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+/*
+ * write_all - write a whole buffer to fd
+ */
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+	ssize_t n = write(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * spill - write the events of every full buffer to the raw file
+ */
+static void spill(void) {
+    rec_buf_t *buf = atomic_exchange(&full_bufs, NULL);
+    while (buf != NULL) {
+	rec_buf_t *next = buf->next;
+	write_all(raw_fd, buf->events, buf->count * sizeof(event_t));
+	real_free(buf);
+	buf = next;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct timespec nap = { 0, WRITER_NAP_NSECS };
+    busy = 1;
+    while (!atomic_load(&writer_stop)) {
+	spill();
+	nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Address to block id map: open addressing with linear probing and
+ * backward-shift deletion, keyed by address
+ */
+typedef struct {
+    uintptr_t *keys;            /* 0 marks an empty slot */
+    int *ids;
+    size_t mask;
+    size_t count;
+} addr_map_t;
+
+static void map_init(addr_map_t *map, size_t cap) {
+    map->keys = calloc(cap, sizeof(uintptr_t));
+    map->ids = calloc(cap, sizeof(int));
+    map->mask = cap - 1;
+    map->count = 0;
+}
+
+static size_t map_slot(const addr_map_t *map, uintptr_t key) {
+    size_t i = (key >> 4) * 0x9e3779b97f4a7c15ull & map->mask;
+    while (map->keys[i] != 0 && map->keys[i] != key)
+	i = (i + 1) & map->mask;
+    return i;
+}
+
+static void map_put(addr_map_t *map, uintptr_t key, int id);
+
+static void map_grow(addr_map_t *map) {
+    addr_map_t old = *map;
+    size_t i;
+    map_init(map, 2 * (old.mask + 1));
+    for (i = 0; i <= old.mask; i++)
+	if (old.keys[i] != 0)
+	    map_put(map, old.keys[i], old.ids[i]);
+    free(old.keys);
+    free(old.ids);
+}
+
+static void map_put(addr_map_t *map, uintptr_t key, int id) {
+    size_t i;
+    if (2 * (map->count + 1) > map->mask + 1)
+	map_grow(map);
+    i = map_slot(map, key);
+    if (map->keys[i] == 0)
+	map->count++;
+    map->keys[i] = key;
+    map->ids[i] = id;
+}
+
+/* Remove key and return its id, or -1 if it is not in the map */
+static int map_take(addr_map_t *map, uintptr_t key) {
+    size_t i = map_slot(map, key), j, home;
+    int id;
+
+    if (map->keys[i] == 0)
+	return -1;
+    id = map->ids[i];
+    map->keys[i] = 0;
+    map->count--;
+    /* shift back the entries of the run that follows */
+    for (j = (i + 1) & map->mask; map->keys[j] != 0; j = (j + 1) & map->mask) {
+	home = (map->keys[j] >> 4) * 0x9e3779b97f4a7c15ull & map->mask;
+	if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+	    map->keys[i] = map->keys[j];
+	    map->ids[i] = map->ids[j];
+	    map->keys[j] = 0;
+	    i = j;
+	}
+    }
+    return id;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t x = ((const event_t *) a)->seq, y = ((const event_t *) b)->seq;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Renaming recorded events into trace requests.  Ids of freed blocks
+ * are reused, so num_ids is the peak number of live blocks.
+ */
+typedef struct {
+    addr_map_t live;            /* address of each live block */
+    addr_map_t moving;          /* old address of each realloc in flight */
+    int *free_ids;              /* stack of reusable ids */
+    int num_free, cap_free;
+    int num_ids;
+    uint64_t *sizes;            /* size of each id, for the peak */
+    uint64_t live_bytes, peak_bytes;
+    uint64_t num_ops;
+} renamer_t;
+
+static int new_id(renamer_t *r) {
+    if (r->num_free > 0)
+	return r->free_ids[--r->num_free];
+    if ((r->num_ids & (r->num_ids - 1)) == 0)
+	r->sizes = realloc(r->sizes, (r->num_ids ? 2 * r->num_ids : 1) * sizeof(uint64_t));
+    r->sizes[r->num_ids] = 0;
+    return r->num_ids++;
+}
+
+static void release_id(renamer_t *r, int id) {
+    if (r->num_free == r->cap_free) {
+	r->cap_free = r->cap_free ? 2 * r->cap_free : 64;
+	r->free_ids = realloc(r->free_ids, r->cap_free * sizeof(int));
+    }
+    r->free_ids[r->num_free++] = id;
+    r->live_bytes -= r->sizes[id];
+    r->sizes[id] = 0;
+}
+
+static void set_size(renamer_t *r, int id, uint64_t size) {
+    r->live_bytes += size - r->sizes[id];
+    r->sizes[id] = size;
+    if (r->live_bytes > r->peak_bytes)
+	r->peak_bytes = r->live_bytes;
+}
+
+/*
+ * rename_event - turn an event into a request; returns 0 if the event
+ *                does not produce one
+ */
+static int rename_event(renamer_t *r, const event_t *ev, int *type, int *id,
+			uint64_t *size) {
+    int old;
+
+    switch (ev->type) {
+    case EV_MALLOC:
+	*type = TRACE_ALLOC;
+	*id = new_id(r);
+	*size = ev->size;
+	map_put(&r->live, ev->ptr, *id);
+	set_size(r, *id, *size);
+	return 1;
+    case EV_FREE:
+	/* blocks from before recording started are not in the trace */
+	if ((*id = map_take(&r->live, ev->ptr)) < 0)
+	    return 0;
+	*type = TRACE_FREE;
+	*size = 0;
+	release_id(r, *id);
+	return 1;
+    case EV_REALLOC_BEGIN:
+	if ((old = map_take(&r->live, ev->ptr)) >= 0)
+	    map_put(&r->moving, ev->ptr, old);
+	return 0;
+    case EV_REALLOC_END:
+	*size = ev->size;
+	if ((old = map_take(&r->moving, ev->old)) < 0) {
+	    /* reallocating a block we never saw allocated */
+	    if (ev->size == 0)
+		return 0;
+	    *type = TRACE_ALLOC;
+	    *id = new_id(r);
+	} else {
+	    *type = TRACE_REALLOC;
+	    *id = old;
+	    if (ev->size == 0) {
+		/* a failed realloc leaves the old block alone */
+		map_put(&r->live, ev->old, old);
+		return 0;
+	    }
+	}
+	map_put(&r->live, ev->ptr, *id);
+	set_size(r, *id, *size);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * write_trace - rename the sorted events and write the trace.  A .rep
+ *               header needs the totals, so that takes two passes.
+ */
+static int write_trace(const event_t *events, size_t n) {
+    renamer_t r;
+    tracebin_writer_t bin;
+    size_t len = strlen(out_path), i;
+    int binary = len > 4 && strcmp(out_path + len - 4, ".bin") == 0;
+    int pass, type, id, num_ids = 0;
+    uint64_t size, num_ops = 0, peak_bytes = 0;
+    FILE *fp = NULL;
+
+    for (pass = 0; pass < 2; pass++) {
+	memset(&r, 0, sizeof(r));
+	map_init(&r.live, 1024);
+	map_init(&r.moving, 64);
+	if (pass == 1) {
+	    if (binary) {
+		if (!tracebin_create(&bin, out_path, 1))
+		    return -1;
+	    } else {
+		if ((fp = fopen(out_path, "w")) == NULL)
+		    return -1;
+		fprintf(fp, "1\n%d\n%llu\n%llu\n", num_ids,
+			(unsigned long long) num_ops,
+			(unsigned long long) peak_bytes);
+	    }
+	}
+	for (i = 0; i < n; i++) {
+	    if (!rename_event(&r, &events[i], &type, &id, &size))
+		continue;
+	    r.num_ops++;
+	    if (pass == 0)
+		continue;
+	    if (binary)
+		tracebin_append(&bin, type, id, size);
+	    else if (type == TRACE_FREE)
+		fprintf(fp, "f %d\n", id);
+	    else
+		fprintf(fp, "%c %d %llu\n", type == TRACE_ALLOC ? 'a' : 'r', id,
+			(unsigned long long) size);
+	}
+	/* like the shipped traces, end with every block freed */
+	for (i = 0; i <= r.live.mask; i++) {
+	    if (r.live.keys[i] == 0)
+		continue;
+	    r.num_ops++;
+	    if (pass == 0)
+		continue;
+	    if (binary)
+		tracebin_append(&bin, TRACE_FREE, r.live.ids[i], 0);
+	    else
+		fprintf(fp, "f %d\n", r.live.ids[i]);
+	}
+	if (pass == 1) {
+	    if (binary ? !tracebin_finish(&bin, r.peak_bytes) : fclose(fp) != 0)
+		return -1;
+	}
+	num_ids = r.num_ids;
+	num_ops = r.num_ops;
+	peak_bytes = r.peak_bytes;
+	free(r.live.keys);
+	free(r.live.ids);
+	free(r.moving.keys);
+	free(r.moving.ids);
+	free(r.free_ids);
+	free(r.sizes);
+	if (num_ops == 0)
+	    break;
+    }
+    return 0;
+}
+
+/*
+ * fork_child - a forked child has no writer thread; stop recording it
+ */
+static void fork_child(void) {
+    atomic_store(&recording, false);
+}
+
+static void __attribute__((constructor)) record_start(void) {
+    static char path_buf[4096];
+    const char *path = getenv("MM_RECORD_FILE");
+    const char *first = getenv("MM_RECORD_PID");
+    char pid[32];
+
+    resolve();
+    busy++;
+    out_path = path != NULL && *path != '\0' ? path : RECORD_FILE;
+    owner = getpid();
+    snprintf(pid, sizeof(pid), "%d", (int) owner);
+    if (first == NULL) {
+	setenv("MM_RECORD_PID", pid, 1);
+    } else if (strcmp(first, pid) != 0) {
+	/* a program run by the recorded one gets a trace of its own */
+	snprintf(path_buf, sizeof(path_buf), "%s.%s", out_path, pid);
+	out_path = path_buf;
+    }
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", out_path);
+    if ((raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0 ||
+	pthread_key_create(&thread_key, thread_exit) != 0 ||
+	pthread_atfork(NULL, NULL, fork_child) != 0 ||
+	pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+	fprintf(stderr, "librecord: cannot record to %s\n", raw_path);
+	busy--;
+	return;
+    }
+    atomic_store(&recording, true);
+    busy--;
+}
+
+static void __attribute__((destructor)) record_finish(void) {
+    struct timespec nap = { 0, 1000 };
+    rec_thread_t *t;
+    rec_buf_t *buf;
+    struct stat st;
+    event_t *events;
+
+    if (!atomic_exchange(&recording, false) || getpid() != owner)
+	return;
+    busy++;
+    atomic_store(&writer_stop, true);
+    pthread_join(writer, NULL);
+    /* wait out threads still appending to their buffers */
+    for (t = atomic_load(&threads); t != NULL; t = t->next) {
+	while (atomic_load_explicit(&t->active, memory_order_acquire))
+	    nanosleep(&nap, NULL);
+	if ((buf = atomic_exchange(&t->buf, NULL)) != NULL)
+	    push_full(buf);
+    }
+    spill();
+
+    if (fstat(raw_fd, &st) == 0 && st.st_size > 0) {
+	events = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		      raw_fd, 0);
+	if (events != MAP_FAILED) {
+	    size_t n = st.st_size / sizeof(event_t);
+	    qsort(events, n, sizeof(event_t), cmp_seq);
+	    if (write_trace(events, n) != 0)
+		fprintf(stderr, "librecord: cannot write %s\n", out_path);
+	    munmap(events, st.st_size);
+	}
+    }
+    close(raw_fd);
+    unlink(raw_path);
+    busy--;
+}
@@ -0,0 +1,63 @@
+/*
+ * rep2bin - convert a text trace (.rep) to the binary trace format
+ * that mdriver maps directly (see tracebin.h)
+ *
+ * usage: rep2bin <trace.rep> <trace.bin>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tracestream.h"
+
+int main(int argc, char **argv)
+{
+    tracestream_t *stream;
+    tracebin_writer_t writer;
+    tracebin_hdr_t hdr;
+    const tracebin_op_t *ops;
+    const uint64_t *big;
+    const char *err;
+    size_t i, n;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <trace.rep> <trace.bin>\n", argv[0]);
+        exit(1);
+    }
+    if ((stream = tracestream_open(argv[1], &hdr, &err)) == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], err);
+        exit(1);
+    }
+    if (hdr.weight > 3) {
+        fprintf(stderr, "%s: weight can only be in {0, 1, 2, 3}\n", argv[1]);
+        exit(1);
+    }
+    if (!tracebin_create(&writer, argv[2], hdr.weight)) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    while ((ops = tracestream_next(stream, &n, &big)) != NULL) {
+        for (i = 0; i < n; i++) {
+            if (!tracebin_append(&writer, ops[i].type, ops[i].index,
+                                 tracebin_size(&ops[i], big))) {
+                perror(argv[2]);
+                exit(1);
+            }
+        }
+    }
+    if (!tracestream_close(stream, &err)) {
+        fprintf(stderr, "%s: %s\n", argv[1], err);
+        exit(1);
+    }
+
+    if (writer.hdr.num_ids != hdr.num_ids) {
+        fprintf(stderr, "%s: header says %llu ids, found %llu\n", argv[1],
+                (unsigned long long) hdr.num_ids,
+                (unsigned long long) writer.hdr.num_ids);
+        exit(1);
+    }
+    if (!tracebin_finish(&writer, hdr.data_bytes)) {
+        perror(argv[2]);
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * rep2c - compile a trace to a C file that replays it without an
+ * interpreter (see nativetrace.h)
+ *
+ * usage: rep2c <trace> <trace.c>
+ *        cc -O2 -fno-plt -shared -fPIC -I<malloclab> trace.c -o trace.so
+ *        mdriver -f <trace> -X ./trace.so
+ *
+ * The requests become a static table of packed records, the same as in
+ * a binary trace, replayed by a tight loop of direct calls
+ * (native_replay): a table keeps the code small enough to stay in the
+ * instruction cache, which straight-line calls for every request do
+ * not.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tracestream.h"
+
+int main(int argc, char **argv)
+{
+    tracestream_t *stream;
+    tracebin_hdr_t hdr;
+    const tracebin_op_t *ops;
+    const uint64_t *chunk_big;
+    uint64_t *big = NULL, num_big = 0, big_cap = 0, b;
+    const char *err, *s;
+    size_t i, n;
+    long num_ops = 0;
+    FILE *fp;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <trace> <trace.c>\n", argv[0]);
+        exit(1);
+    }
+    if ((stream = tracestream_open(argv[1], &hdr, &err)) == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], err);
+        exit(1);
+    }
+    if ((fp = fopen(argv[2], "w")) == NULL) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    fprintf(fp, "/* Generated by rep2c from %s */\n", argv[1]);
+    fprintf(fp, "#include \"nativetrace.h\"\n\n");
+    fprintf(fp, "static const tracebin_op_t ops[] = {\n");
+    /* the stream numbers big sizes per chunk; renumber them for the table */
+    while ((ops = tracestream_next(stream, &n, &chunk_big)) != NULL) {
+        for (i = 0; i < n; i++, num_ops++) {
+            tracebin_op_t op;
+            if (!tracebin_pack(&op, ops[i].type, ops[i].index,
+                               tracebin_size(&ops[i], chunk_big),
+                               &big, &num_big, &big_cap)) {
+                fprintf(stderr, "%s: out of memory\n", argv[0]);
+                exit(1);
+            }
+            fprintf(fp, "    { %u, %u, %lluu, %d },\n", (unsigned) op.type,
+                    (unsigned) op.big, (unsigned long long) op.size,
+                    (int) op.index);
+        }
+    }
+    if (!tracestream_close(stream, &err)) {
+        fprintf(stderr, "%s: %s\n", argv[1], err);
+        exit(1);
+    }
+    if (num_ops == 0)
+        fprintf(fp, "    { 0, 0, 0, 0 }\n");
+    fprintf(fp, "};\n\nstatic const uint64_t big[] = {\n");
+    for (b = 0; b < num_big; b++)
+        fprintf(fp, "    %lluull,\n", (unsigned long long) big[b]);
+    if (num_big == 0)
+        fprintf(fp, "    0\n");
+    fprintf(fp, "};\n");
+
+    fprintf(fp, "\nstatic void run(void **p)\n{\n");
+    fprintf(fp, "    native_replay(ops, %ld, big, p);\n}\n", num_ops);
+    fprintf(fp, "\nconst native_trace_t native_trace = {\n    \"");
+    for (s = argv[1]; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        fputc(*s, fp);
+    }
+    fprintf(fp, "\", %llu, %ld, run\n};\n",
+            (unsigned long long) hdr.num_ids, num_ops);
+
+    if (fclose(fp) != 0) {
+        perror(argv[2]);
+        exit(1);
+    }
+    return 0;
+}
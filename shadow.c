@@ -0,0 +1,129 @@
+/*
+ * Shadow bitmap of the simulated heap
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "shadow.h"
+
+#define LEAF_BITS  (1ul << (SHADOW_LEAF_SHIFT - SHADOW_SHIFT))
+#define LEAF_WORDS (LEAF_BITS / 64)
+
+typedef enum { SHADOW_TEST, SHADOW_SET, SHADOW_CLEAR } shadow_op_t;
+
+static void *shadow_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (!p) {
+	fprintf(stderr, "ERROR.  Couldn't allocate shadow bitmap\n");
+	exit(1);
+    }
+    return p;
+}
+
+/* Bitmap of leaf, allocating it (and growing the directory) if create */
+static uint64_t *leaf_of(shadow_t *shadow, size_t leaf, bool create) {
+    if (leaf >= shadow->num_leaves) {
+	if (!create)
+	    return NULL;
+	size_t n = shadow->num_leaves ? shadow->num_leaves : 16;
+	while (n <= leaf)
+	    n *= 2;
+	uint64_t **leaves = shadow_alloc(n * sizeof(*leaves));
+	if (shadow->num_leaves > 0)
+	    memcpy(leaves, shadow->leaves,
+		   shadow->num_leaves * sizeof(*leaves));
+	free(shadow->leaves);
+	shadow->leaves = leaves;
+	shadow->num_leaves = n;
+    }
+    if (shadow->leaves[leaf] == NULL && create)
+	shadow->leaves[leaf] = shadow_alloc(LEAF_WORDS * sizeof(uint64_t));
+    return shadow->leaves[leaf];
+}
+
+/*
+ * Apply op to bits [bit, bit + len) of one leaf, a 64-bit word at a
+ * time.  For SHADOW_TEST, return the first set bit, else LEAF_BITS.
+ */
+static size_t apply_leaf(uint64_t *words, size_t bit, size_t len,
+			 shadow_op_t op) {
+    size_t end = bit + len;
+
+    while (bit < end) {
+	size_t w = bit / 64, shift = bit % 64;
+	size_t n = end - bit < 64 - shift ? end - bit : 64 - shift;
+	uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << shift;
+
+	switch (op) {
+	case SHADOW_TEST:
+	    if (words[w] & mask)
+		return w * 64 + __builtin_ctzll(words[w] & mask);
+	    break;
+	case SHADOW_SET:
+	    words[w] |= mask;
+	    break;
+	case SHADOW_CLEAR:
+	    words[w] &= ~mask;
+	    break;
+	}
+	bit += n;
+    }
+    return LEAF_BITS;
+}
+
+/*
+ * Apply op to the granules covering [lo, lo + size).  For SHADOW_TEST,
+ * return the index of the first set one, else SIZE_MAX.
+ */
+static size_t apply(shadow_t *shadow, const void *lo, size_t size,
+		    shadow_op_t op) {
+    size_t g = (size_t) ((const char *) lo - shadow->base) >> SHADOW_SHIFT;
+    size_t n = (size + SHADOW_GRANULE - 1) >> SHADOW_SHIFT;
+
+    while (n > 0) {
+	size_t leaf = g / LEAF_BITS, bit = g % LEAF_BITS;
+	size_t len = n < LEAF_BITS - bit ? n : LEAF_BITS - bit;
+	uint64_t *words = leaf_of(shadow, leaf, op == SHADOW_SET);
+
+	if (words != NULL) {
+	    size_t first = apply_leaf(words, bit, len, op);
+	    if (first != LEAF_BITS)
+		return leaf * LEAF_BITS + first;
+	}
+	g += len;
+	n -= len;
+    }
+    return SIZE_MAX;
+}
+
+shadow_t *shadow_new() {
+    return shadow_alloc(sizeof(shadow_t));
+}
+
+void shadow_free(shadow_t *shadow) {
+    for (size_t i = 0; i < shadow->num_leaves; i++)
+	free(shadow->leaves[i]);
+    free(shadow->leaves);
+    free(shadow);
+}
+
+void shadow_reset(shadow_t *shadow, const void *base) {
+    for (size_t i = 0; i < shadow->num_leaves; i++)
+	if (shadow->leaves[i] != NULL)
+	    memset(shadow->leaves[i], 0, LEAF_WORDS * sizeof(uint64_t));
+    shadow->base = (char *) base;
+}
+
+void *shadow_mark(shadow_t *shadow, const void *lo, size_t size) {
+    size_t first = apply(shadow, lo, size, SHADOW_TEST);
+    if (first != SIZE_MAX)
+	return shadow->base + (first << SHADOW_SHIFT);
+    apply(shadow, lo, size, SHADOW_SET);
+    return NULL;
+}
+
+void shadow_unmark(shadow_t *shadow, const void *lo, size_t size) {
+    apply(shadow, lo, size, SHADOW_CLEAR);
+}
@@ -0,0 +1,34 @@
+/*
+ * Shadow bitmap of the simulated heap: one bit per SHADOW_GRANULE bytes,
+ * set while some allocated payload covers the granule.  The bitmap is
+ * split into leaves that are allocated the first time a payload lands
+ * in their part of the heap, so a heap that grows to many gigabytes
+ * costs shadow memory only where it was used.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHADOW_SHIFT   4                    /* 16-byte granules */
+#define SHADOW_GRANULE (1 << SHADOW_SHIFT)
+#define SHADOW_LEAF_SHIFT 22                /* each leaf covers 4 MB of heap */
+
+typedef struct {
+    char *base;          /* heap address of granule 0 */
+    size_t num_leaves;   /* length of the leaf directory */
+    uint64_t **leaves;   /* leaf bitmaps, NULL where nothing was marked */
+} shadow_t;
+
+shadow_t *shadow_new();
+
+void shadow_free(shadow_t *shadow);
+
+/* Clear every bit, and count granules from base from now on */
+void shadow_reset(shadow_t *shadow, const void *base);
+
+/* Mark the granules of [lo, lo + size) as covered.  If any of them
+   already is, mark nothing and return the address of the first one;
+   otherwise return NULL.  lo must not lie below base */
+void *shadow_mark(shadow_t *shadow, const void *lo, size_t size);
+
+/* Clear the granules of [lo, lo + size) */
+void shadow_unmark(shadow_t *shadow, const void *lo, size_t size);
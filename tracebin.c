@@ -0,0 +1,171 @@
+/*
+ * Binary trace files
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tracebin.h"
+
+#define FNV_PRIME 0x100000001b3ull
+
+uint64_t tracebin_fnv(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+	hash ^= p[i];
+	hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+bool tracebin_valid(const tracebin_op_t *op, uint64_t num_ids,
+                    uint64_t num_big) {
+    if (op->type > TRACE_REALLOC)
+	return false;
+    if (op->index == -1)
+	return op->type == TRACE_FREE;
+    if (op->index < 0 || (uint64_t) op->index >= num_ids)
+	return false;
+    return !op->big || op->size < num_big;
+}
+
+const tracebin_hdr_t *tracebin_map(const char *path, size_t *len,
+                                   const char **err) {
+    tracebin_hdr_t hdr;
+    const tracebin_op_t *ops;
+    struct stat st;
+    uint64_t i;
+    void *addr;
+    int fd;
+
+    *err = NULL;
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+    if (fstat(fd, &st) != 0 ||
+	pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+	hdr.magic != TRACEBIN_MAGIC) {
+	close(fd);
+	return NULL;
+    }
+    if (hdr.version != TRACEBIN_VERSION) {
+	*err = "unsupported binary trace version";
+	close(fd);
+	return NULL;
+    }
+    if (hdr.num_ops > (st.st_size - sizeof(hdr)) / sizeof(tracebin_op_t) ||
+	hdr.num_big > (st.st_size - sizeof(hdr)) / sizeof(uint64_t) ||
+	sizeof(hdr) + hdr.num_ops * sizeof(tracebin_op_t) +
+	hdr.num_big * sizeof(uint64_t) != (uint64_t) st.st_size) {
+	*err = "binary trace is truncated";
+	close(fd);
+	return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+	*err = "cannot map binary trace";
+	return NULL;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    if (tracebin_fnv(TRACEBIN_FNV_BASIS, (tracebin_hdr_t *) addr + 1,
+		     st.st_size - sizeof(hdr)) != hdr.checksum) {
+	munmap(addr, st.st_size);
+	*err = "binary trace checksum mismatch";
+	return NULL;
+    }
+    ops = tracebin_ops(addr);
+    for (i = 0; i < hdr.num_ops; i++) {
+	if (!tracebin_valid(&ops[i], hdr.num_ids, hdr.num_big)) {
+	    munmap(addr, st.st_size);
+	    *err = "binary trace has a bad request";
+	    return NULL;
+	}
+    }
+    *len = st.st_size;
+    return addr;
+}
+
+void tracebin_unmap(const tracebin_hdr_t *hdr, size_t len) {
+    munmap((void *) hdr, len);
+}
+
+const tracebin_op_t *tracebin_ops(const tracebin_hdr_t *hdr) {
+    return (const tracebin_op_t *) (hdr + 1);
+}
+
+const uint64_t *tracebin_big(const tracebin_hdr_t *hdr) {
+    return (const uint64_t *) (tracebin_ops(hdr) + hdr->num_ops);
+}
+
+bool tracebin_pack(tracebin_op_t *op, int type, int index, uint64_t size,
+                   uint64_t **big, uint64_t *num_big, uint64_t *big_cap) {
+    op->type = type;
+    op->index = index;
+    op->big = size > TRACEBIN_SMALL_MAX;
+    if (!op->big) {
+	op->size = size;
+	return true;
+    }
+    if (*num_big > TRACEBIN_SMALL_MAX)
+	return false;
+    if (*num_big == *big_cap) {
+	uint64_t cap = *big_cap ? 2 * *big_cap : 64;
+	uint64_t *table = realloc(*big, cap * sizeof(uint64_t));
+	if (table == NULL)
+	    return false;
+	*big = table;
+	*big_cap = cap;
+    }
+    op->size = *num_big;
+    (*big)[(*num_big)++] = size;
+    return true;
+}
+
+bool tracebin_create(tracebin_writer_t *writer, const char *path,
+                     uint32_t weight) {
+    memset(&writer->hdr, 0, sizeof(writer->hdr));
+    writer->hdr.magic = TRACEBIN_MAGIC;
+    writer->hdr.version = TRACEBIN_VERSION;
+    writer->hdr.weight = weight;
+    writer->hdr.checksum = TRACEBIN_FNV_BASIS;
+    writer->big = NULL;
+    writer->big_cap = 0;
+    if ((writer->fp = fopen(path, "wb")) == NULL)
+	return false;
+    /* the real header is written by tracebin_finish */
+    return fwrite(&writer->hdr, sizeof(writer->hdr), 1, writer->fp) == 1;
+}
+
+bool tracebin_append(tracebin_writer_t *writer, int type, int index,
+                     uint64_t size) {
+    tracebin_op_t op;
+    if (!tracebin_pack(&op, type, index, size, &writer->big,
+		       &writer->hdr.num_big, &writer->big_cap))
+	return false;
+    writer->hdr.checksum = tracebin_fnv(writer->hdr.checksum, &op, sizeof(op));
+    writer->hdr.num_ops++;
+    if (index >= 0 && (uint64_t) index >= writer->hdr.num_ids)
+	writer->hdr.num_ids = index + 1;
+    return fwrite(&op, sizeof(op), 1, writer->fp) == 1;
+}
+
+bool tracebin_finish(tracebin_writer_t *writer, uint64_t data_bytes) {
+    size_t len = writer->hdr.num_big * sizeof(uint64_t);
+    bool ok;
+    writer->hdr.data_bytes = data_bytes;
+    writer->hdr.checksum = tracebin_fnv(writer->hdr.checksum, writer->big, len);
+    ok = fwrite(writer->big, sizeof(uint64_t), writer->hdr.num_big, writer->fp)
+	== writer->hdr.num_big &&
+	fseek(writer->fp, 0, SEEK_SET) == 0 &&
+	fwrite(&writer->hdr, sizeof(writer->hdr), 1, writer->fp) == 1;
+    free(writer->big);
+    writer->big = NULL;
+    return fclose(writer->fp) == 0 && ok;
+}
+
+/* The records are replayed in place, so their layout must not drift */
+_Static_assert(sizeof(tracebin_op_t) == 8, "tracebin_op_t must pack into 8 bytes");
@@ -0,0 +1,97 @@
+/*
+ * Binary trace files
+ *
+ * A 64-byte header is followed by num_ops 8-byte request records and
+ * then num_big 8-byte sizes, all in host byte order, so the driver can
+ * map a file and replay the records in place instead of parsing text.
+ * rep2bin converts .rep files.
+ */
+#ifndef TRACEBIN_H
+#define TRACEBIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACEBIN_MAGIC   0x45434152544d4d7full /* "\177MMTRACE" */
+#define TRACEBIN_VERSION 2
+
+/* Request types */
+enum { TRACE_ALLOC, TRACE_FREE, TRACE_REALLOC };
+
+/*
+ * One allocator request, packed so that replaying a trace drags as
+ * little driver memory through the cache as possible.  Sizes that do
+ * not fit in TRACEBIN_SIZE_BITS are kept in a separate table of big
+ * sizes, and size holds their position in it.
+ */
+#define TRACEBIN_SIZE_BITS 29
+#define TRACEBIN_SMALL_MAX ((1ul << TRACEBIN_SIZE_BITS) - 1)
+
+typedef struct {
+    uint64_t type : 2;  /* TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC */
+    uint64_t big : 1;   /* size is an index into the big size table */
+    uint64_t size : TRACEBIN_SIZE_BITS; /* byte size of alloc/realloc request */
+    int64_t index : 32; /* block id; -1 frees the null pointer */
+} tracebin_op_t;
+
+/* The byte size of op, whose big sizes are in the table big */
+static inline uint64_t tracebin_size(const tracebin_op_t *op, const uint64_t *big)
+{
+    return op->big ? big[op->size] : op->size;
+}
+
+typedef struct {
+    uint64_t magic;     /* TRACEBIN_MAGIC */
+    uint32_t version;   /* TRACEBIN_VERSION */
+    uint32_t weight;    /* weight of the trace, as in a .rep header */
+    uint64_t num_ids;   /* number of block ids */
+    uint64_t num_ops;   /* number of request records */
+    uint64_t data_bytes; /* peak number of data bytes allocated */
+    uint64_t checksum;  /* FNV-1a hash of the request records and big sizes */
+    uint64_t num_big;   /* number of big sizes */
+    uint64_t reserved;
+} tracebin_hdr_t;
+
+/* Hash len bytes at data, continuing from hash (start with TRACEBIN_FNV_BASIS) */
+#define TRACEBIN_FNV_BASIS 0xcbf29ce484222325ull
+uint64_t tracebin_fnv(uint64_t hash, const void *data, size_t len);
+
+/* Is op a request the driver can replay on a trace of num_ids blocks
+   with num_big big sizes?  Id -1 is only allowed on a free */
+bool tracebin_valid(const tracebin_op_t *op, uint64_t num_ids,
+                    uint64_t num_big);
+
+/* Map the binary trace in path read-only.  Returns NULL and sets *err
+   to NULL if path is not a binary trace, or to a message if it is a
+   damaged one or has a request that is not tracebin_valid */
+const tracebin_hdr_t *tracebin_map(const char *path, size_t *len,
+                                   const char **err);
+void tracebin_unmap(const tracebin_hdr_t *hdr, size_t len);
+
+/* The request records and big sizes that follow the header */
+const tracebin_op_t *tracebin_ops(const tracebin_hdr_t *hdr);
+const uint64_t *tracebin_big(const tracebin_hdr_t *hdr);
+
+/* Pack a request, adding its size to the table *big of *num_big
+   entries (allocated room: *big_cap) if it is too big to inline.
+   Returns false if the table cannot grow */
+bool tracebin_pack(tracebin_op_t *op, int type, int index, uint64_t size,
+                   uint64_t **big, uint64_t *num_big, uint64_t *big_cap);
+
+/* Writing a binary trace one request at a time */
+typedef struct {
+    FILE *fp;
+    tracebin_hdr_t hdr;
+    uint64_t *big;      /* big sizes, written after the requests */
+    uint64_t big_cap;
+} tracebin_writer_t;
+
+bool tracebin_create(tracebin_writer_t *writer, const char *path,
+                     uint32_t weight);
+bool tracebin_append(tracebin_writer_t *writer, int type, int index,
+                     uint64_t size);
+/* Write the big sizes and the header, and close the file */
+bool tracebin_finish(tracebin_writer_t *writer, uint64_t data_bytes);
+
+#endif /* TRACEBIN_H */
@@ -0,0 +1,248 @@
+/*
+ * Streaming trace reader
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracestream.h"
+
+struct tracestream {
+    FILE *fp;
+    bool binary;
+    tracebin_hdr_t hdr;
+    uint64_t left;              /* requests not decoded yet */
+    uint64_t checksum;          /* of the binary records decoded so far */
+    uint64_t *file_big;         /* big sizes of a binary trace */
+    const char *err;
+
+    /* double buffer shared with the reader thread */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    tracebin_op_t *buf[2];
+    size_t count[2];            /* requests in each buffer; 0 marks the end */
+    uint64_t *big[2];           /* big sizes of a text trace, per buffer */
+    uint64_t num_big[2];
+    uint64_t big_cap[2];
+    bool full[2];
+    bool stop;                  /* the consumer has closed the stream */
+    bool ended;                 /* the consumer has seen the end */
+    int cur;                    /* buffer held by the consumer, or -1 */
+};
+
+/* Decode up to STREAM_CHUNK_OPS requests of a binary trace */
+static size_t fill_binary(tracestream_t *s, int b) {
+    size_t n = s->left < STREAM_CHUNK_OPS ? s->left : STREAM_CHUNK_OPS;
+    size_t i;
+    if (n == 0)
+	return 0;
+    if (fread(s->buf[b], sizeof(tracebin_op_t), n, s->fp) != n) {
+	s->err = "binary trace is truncated";
+	return 0;
+    }
+    s->checksum = tracebin_fnv(s->checksum, s->buf[b], n * sizeof(tracebin_op_t));
+    for (i = 0; i < n; i++) {
+	if (!tracebin_valid(&s->buf[b][i], s->hdr.num_ids, s->hdr.num_big)) {
+	    s->err = "binary trace has a bad request";
+	    return 0;
+	}
+    }
+    s->left -= n;
+    if (s->left == 0 &&
+	tracebin_fnv(s->checksum, s->file_big, s->hdr.num_big * sizeof(uint64_t))
+	!= s->hdr.checksum) {
+	s->err = "binary trace checksum mismatch";
+	return 0;
+    }
+    return n;
+}
+
+/* Decode up to STREAM_CHUNK_OPS request lines of a text trace */
+static size_t fill_text(tracestream_t *s, int b) {
+    size_t n;
+    char type[2];
+    int index;
+    unsigned long size;
+
+    s->num_big[b] = 0;
+    for (n = 0; n < STREAM_CHUNK_OPS && s->left > 0; n++, s->left--) {
+	if (fscanf(s->fp, "%1s %d", type, &index) != 2) {
+	    s->err = "trace has fewer requests than its header says";
+	    return 0;
+	}
+	if (index < -1 || index >= (int64_t) s->hdr.num_ids ||
+	    (index == -1 && type[0] != 'f')) {
+	    s->err = "request index out of range";
+	    return 0;
+	}
+	size = 0;
+	if (type[0] != 'f' && fscanf(s->fp, "%lu", &size) != 1) {
+	    s->err = "alloc or realloc request without a size";
+	    return 0;
+	}
+	if (type[0] != 'a' && type[0] != 'r' && type[0] != 'f') {
+	    s->err = "bogus request type character";
+	    return 0;
+	}
+	if (!tracebin_pack(&s->buf[b][n],
+			   type[0] == 'a' ? TRACE_ALLOC :
+			   type[0] == 'r' ? TRACE_REALLOC : TRACE_FREE,
+			   index, size, &s->big[b], &s->num_big[b], &s->big_cap[b])) {
+	    s->err = "out of memory";
+	    return 0;
+	}
+    }
+    return n;
+}
+
+static void *reader_thread(void *arg) {
+    tracestream_t *s = arg;
+    int b = 0;
+    size_t n;
+    bool stop;
+
+    do {
+	pthread_mutex_lock(&s->lock);
+	while (s->full[b] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	if (stop)
+	    break;
+
+	n = s->binary ? fill_binary(s, b) : fill_text(s, b);
+
+	pthread_mutex_lock(&s->lock);
+	s->count[b] = n;
+	s->full[b] = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	b ^= 1;
+    } while (n > 0);
+    return NULL;
+}
+
+/* Load the big sizes stored after the requests of a binary trace */
+static bool read_file_big(tracestream_t *s) {
+    size_t len = s->hdr.num_big * sizeof(uint64_t);
+    if (s->hdr.num_big > SIZE_MAX / sizeof(uint64_t) ||
+	(s->file_big = malloc(len ? len : 1)) == NULL)
+	return false;
+    return fseek(s->fp, sizeof(s->hdr) + s->hdr.num_ops * sizeof(tracebin_op_t),
+		 SEEK_SET) == 0 &&
+	fread(s->file_big, 1, len, s->fp) == len &&
+	fseek(s->fp, sizeof(s->hdr), SEEK_SET) == 0;
+}
+
+static void free_stream(tracestream_t *s) {
+    fclose(s->fp);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    free(s->big[0]);
+    free(s->big[1]);
+    free(s->file_big);
+    free(s);
+}
+
+tracestream_t *tracestream_open(const char *path, tracebin_hdr_t *hdr,
+                                const char **err) {
+    tracestream_t *s = calloc(1, sizeof(tracestream_t));
+    int weight, num_ids, num_ops;
+    size_t data_bytes;
+
+    *err = NULL;
+    if (s == NULL) {
+	*err = "out of memory";
+	return NULL;
+    }
+    if ((s->fp = fopen(path, "rb")) == NULL) {
+	*err = "cannot open trace";
+	free(s);
+	return NULL;
+    }
+    if (fread(&s->hdr, sizeof(s->hdr), 1, s->fp) == 1 &&
+	s->hdr.magic == TRACEBIN_MAGIC) {
+	s->binary = true;
+	if (s->hdr.version != TRACEBIN_VERSION)
+	    *err = "unsupported binary trace version";
+	else if (!read_file_big(s))
+	    *err = "binary trace is truncated";
+    } else {
+	rewind(s->fp);
+	memset(&s->hdr, 0, sizeof(s->hdr));
+	if (fscanf(s->fp, "%d %d %d %zu", &weight, &num_ids, &num_ops,
+		   &data_bytes) != 4 || num_ids < 0 || num_ops < 0) {
+	    *err = "bad trace header";
+	} else {
+	    s->hdr.weight = weight;
+	    s->hdr.num_ids = num_ids;
+	    s->hdr.num_ops = num_ops;
+	    s->hdr.data_bytes = data_bytes;
+	}
+    }
+    s->buf[0] = malloc(STREAM_CHUNK_OPS * sizeof(tracebin_op_t));
+    s->buf[1] = malloc(STREAM_CHUNK_OPS * sizeof(tracebin_op_t));
+    if (s->buf[0] == NULL || s->buf[1] == NULL)
+	*err = "out of memory";
+    if (*err != NULL) {
+	free_stream(s);
+	return NULL;
+    }
+
+    s->left = s->hdr.num_ops;
+    s->checksum = TRACEBIN_FNV_BASIS;
+    s->cur = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->reader, NULL, reader_thread, s) != 0) {
+	*err = "cannot start reader thread";
+	free_stream(s);
+	return NULL;
+    }
+    *hdr = s->hdr;
+    return s;
+}
+
+const tracebin_op_t *tracestream_next(tracestream_t *s, size_t *n,
+                                      const uint64_t **big) {
+    int b;
+
+    if (s->ended)
+	return NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->cur >= 0) {
+	/* hand the buffer we are done with back to the reader */
+	s->full[s->cur] = false;
+	pthread_cond_broadcast(&s->cond);
+    }
+    b = s->cur < 0 ? 0 : s->cur ^ 1;
+    while (!s->full[b])
+	pthread_cond_wait(&s->cond, &s->lock);
+    s->cur = b;
+    *n = s->count[b];
+    pthread_mutex_unlock(&s->lock);
+    if (*n == 0) {
+	s->ended = true;
+	return NULL;
+    }
+    *big = s->binary ? s->file_big : s->big[b];
+    return s->buf[b];
+}
+
+bool tracestream_close(tracestream_t *s, const char **err) {
+    bool ok;
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->reader, NULL);
+
+    *err = s->err;
+    ok = s->err == NULL;
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free_stream(s);
+    return ok;
+}
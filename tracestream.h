@@ -0,0 +1,25 @@
+/*
+ * Streaming trace reader
+ *
+ * Reads a text or binary trace in chunks of STREAM_CHUNK_OPS requests.
+ * A reader thread decodes the next chunk while the caller replays the
+ * current one, so a trace of any length is replayed in constant memory.
+ */
+#include "tracebin.h"
+
+#define STREAM_CHUNK_OPS (1 << 17) /* 1 MB of requests per chunk */
+
+typedef struct tracestream tracestream_t;
+
+/* Open the trace in path and read its header into hdr (the checksum
+   field is unused).  Returns NULL and sets *err on failure */
+tracestream_t *tracestream_open(const char *path, tracebin_hdr_t *hdr,
+                                const char **err);
+
+/* The next chunk of requests, valid until the next call, and the table
+   of big sizes they refer to; NULL at the end of the trace or on error */
+const tracebin_op_t *tracestream_next(tracestream_t *stream, size_t *n,
+                                      const uint64_t **big);
+
+/* Stop reading.  Returns false and sets *err if the trace was bad */
+bool tracestream_close(tracestream_t *stream, const char **err);